@@ -0,0 +1,133 @@
+/*
+    Conversion kernel benchmark for the PulseAudio output plugin
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Runs every float conversion kernel this CPU supports over the same
+    input, checks the output byte for byte against the scalar reference
+    and reports throughput in input samples per microsecond. The input
+    covers full scale, clipping and rounding ties, and the block size is
+    odd so the scalar tails run too.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../convert.h"
+
+static const char *format_names[CONVERT_FORMATS] = {
+    [CONVERT_S16] = "s16le",
+    [CONVERT_S24_32] = "s24_32le",
+    [CONVERT_S24] = "s24le",
+};
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fill_input(float *src, size_t samples)
+{
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < samples; i++) {
+        seed = seed * 1664525 + 1013904223;
+        switch (i % 8) {
+        case 0:
+            // Exact halves of an S16 step, rounding ties
+            src[i] = ((int)(seed >> 17) - 16384 + 0.5f) / 32768.0f;
+            break;
+        case 1:
+            // Past full scale, must clip
+            src[i] = (seed & 1 ? 1.0f : -1.0f) * (1.0f + (seed >> 8) / 16777216.0f);
+            break;
+        default:
+            src[i] = ((int32_t)seed) / 2147483648.0f;
+            break;
+        }
+    }
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-s block_samples] [-t iterations]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t block = 4097;
+    int iterations = 20000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:t:h")) != -1) {
+        switch (opt) {
+        case 's': block = strtoul(optarg, NULL, 10); break;
+        case 't': iterations = atoi(optarg); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (block < 1 || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    float *src = malloc(block * sizeof(float));
+    uint8_t *ref = malloc(block * 4);
+    // One guard byte past the largest output to catch overlong stores
+    uint8_t *dst = malloc(block * 4 + 1);
+    int failed = 0;
+
+    fill_input(src, block);
+
+    printf("%zu samples per block, %d blocks\n", block, iterations);
+    printf("%-10s %-8s %12s %10s\n", "format", "kernel", "samples/us", "speedup");
+
+    for (int f = CONVERT_NONE + 1; f < CONVERT_FORMATS; f++) {
+        size_t size = convert_sample_size(f) * block;
+        double scalar_rate = 0;
+
+        convert_get(f, CONVERT_SCALAR)(ref, src, block);
+
+        for (int isa = 0; isa < CONVERT_ISAS; isa++) {
+            convert_fn fn = convert_get(f, isa);
+            if (!fn)
+                continue;
+
+            memset(dst, 0xaa, block * 4 + 1);
+            fn(dst, src, block);
+            if (memcmp(dst, ref, size) || dst[size] != 0xaa) {
+                fprintf(stderr, "%s %s: output differs from the scalar reference\n",
+                        format_names[f], convert_isa_name(isa));
+                failed = 1;
+            }
+
+            uint64_t t = now_usec();
+            for (int i = 0; i < iterations; i++) {
+                fn(dst, src, block);
+                __asm__ volatile("" : : "r"(dst) : "memory");
+            }
+            uint64_t elapsed = now_usec() - t;
+
+            double rate = elapsed ? (double)block * iterations / elapsed : 0.0;
+            if (isa == CONVERT_SCALAR)
+                scalar_rate = rate;
+            printf("%-10s %-8s %12.1f %9.2fx\n", format_names[f], convert_isa_name(isa),
+                   rate, scalar_rate ? rate / scalar_rate : 0.0);
+        }
+    }
+
+    free(src);
+    free(ref);
+    free(dst);
+    return failed;
+}
@@ -0,0 +1,216 @@
+/*
+    Offline benchmark for the PulseAudio output plugin
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Links pulse.c against the stub libpulse and the mock DeaDBeeF API and
+    drives the stream write callback the way the server would: one full
+    buffer at start, then minreq sized requests. Reports throughput over
+    the time spent inside the callback,
+    write callback latency percentiles, writes and allocations per
+    callback for every sample format pulse_set_spec handles.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mock_deadbeef.h"
+#include "stub_pulse.h"
+
+DB_plugin_t *pulse2_load(DB_functions_t *api);
+
+/* Allocation counting, the benchmark is linked with --wrap for these */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t allocs;
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+struct bench_format {
+    const char *name;
+    int bps;
+    int is_float;
+};
+
+static const struct bench_format formats[] = {
+    { "u8", 8, 0 },
+    { "s16le", 16, 0 },
+    { "s24le", 24, 0 },
+    { "s32le", 32, 0 },
+    { "float32le", 32, 1 },
+};
+
+static int cmp_usec(const void *a, const void *b)
+{
+    pa_usec_t x = *(const pa_usec_t *)a, y = *(const pa_usec_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-n callbacks] [-r samplerate] [-c channels] [-b buffer_ms]\n"
+            "          [-q request_ms] [-m max_read_bytes] [-p prefetch_ms] [-f format] [-R] [-x] [-v]\n"
+            "  -R  pace requests in real time instead of back to back\n"
+            "  -x  native format with in-plugin conversion to the stub sink's s16le\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int callbacks = 20000;
+    int samplerate = 44100;
+    int channels = 2;
+    int buffer_ms = 100;
+    int request_ms = 25;
+    int prefetch_ms = 0;
+    int realtime = 0;
+    int convert = 0;
+    const char *only = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:c:b:q:m:p:f:Rxvh")) != -1) {
+        switch (opt) {
+        case 'n': callbacks = atoi(optarg); break;
+        case 'r': samplerate = atoi(optarg); break;
+        case 'c': channels = atoi(optarg); break;
+        case 'b': buffer_ms = atoi(optarg); break;
+        case 'q': request_ms = atoi(optarg); break;
+        case 'm': mock_set_read_max(atoi(optarg)); break;
+        case 'p': prefetch_ms = atoi(optarg); break;
+        case 'f': only = optarg; break;
+        case 'R': realtime = 1; break;
+        case 'x': convert = 1; break;
+        case 'v': mock_set_verbose(1); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (callbacks < 1 || samplerate < 1 || channels < 1 || request_ms < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mock_conf_set_int("pulse2.buffersize", buffer_ms);
+    mock_conf_set_int("pulse2.prefetch", prefetch_ms);
+    mock_conf_set_int("pulse2.nativeformat", convert);
+    mock_conf_set_int("pulse2.convert", convert);
+
+    DB_output_t *output = (DB_output_t *)pulse2_load(mock_deadbeef_api());
+    output->plugin.start();
+
+    pa_usec_t *lat = malloc(callbacks * sizeof(*lat));
+
+    printf("%d Hz, %d ch, buffer %d ms, request %d ms, prefetch %d ms, %d callbacks\n",
+           samplerate, channels, buffer_ms, request_ms, prefetch_ms, callbacks);
+    printf("%-10s %10s %8s %8s %8s %8s %12s %12s\n",
+           "format", "MB/s", "p50 us", "p95 us", "p99 us", "max us", "writes/cb", "allocs/cb");
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        if (only && strcmp(only, formats[f].name))
+            continue;
+
+        ddb_waveformat_t fmt = {
+            .bps = formats[f].bps,
+            .is_float = formats[f].is_float,
+            .channels = channels,
+            .samplerate = samplerate,
+            .channelmask = channels == 1 ? 1 : 3,
+        };
+        if (convert) {
+            // Native format negotiates float for the plugin to convert
+            ddb_waveformat_t f = fmt;
+            f.bps = 32;
+            f.is_float = 1;
+            mock_set_format(&f);
+        } else {
+            mock_set_format(&fmt);
+        }
+        output->setformat(&fmt);
+        if (output->play() < 0) {
+            fprintf(stderr, "%s: play failed\n", formats[f].name);
+            continue;
+        }
+
+        pa_stream *s = stub_last_stream();
+        if (!s) {
+            fprintf(stderr, "%s: no stream\n", formats[f].name);
+            output->stop();
+            continue;
+        }
+
+        // Requests are in the stream's format, which native format mode may change
+        size_t frame = pa_frame_size(pa_stream_get_sample_spec(s));
+        size_t request = (size_t)samplerate * request_ms / 1000 * frame;
+        size_t full = (size_t)samplerate * buffer_ms / 1000 * frame;
+
+        if (prefetch_ms) {
+            // Let the producer thread fill the ring before the first request
+            usleep(prefetch_ms * 1000 * 2);
+        }
+
+        // Server asks for the whole buffer when the stream starts
+        stub_stream_request(s, full);
+
+        uint64_t writes0 = stub_stream_writes(s);
+        uint64_t bytes0 = stub_stream_bytes(s);
+        uint64_t allocs0 = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+        pa_usec_t elapsed = 0;
+
+        for (int i = 0; i < callbacks; i++) {
+            pa_usec_t t = pa_rtclock_now();
+            stub_stream_request(s, request);
+            lat[i] = pa_rtclock_now() - t;
+            elapsed += lat[i];
+            if (realtime)
+                usleep(request_ms * 1000);
+        }
+
+        uint64_t nallocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - allocs0;
+        uint64_t nwrites = stub_stream_writes(s) - writes0;
+        uint64_t nbytes = stub_stream_bytes(s) - bytes0;
+
+        qsort(lat, callbacks, sizeof(*lat), cmp_usec);
+        printf("%-10s %10.1f %8llu %8llu %8llu %8llu %12.2f %12.3f\n",
+               formats[f].name,
+               elapsed ? (double)nbytes / elapsed : 0.0,
+               (unsigned long long)lat[callbacks / 2],
+               (unsigned long long)lat[callbacks * 95 / 100],
+               (unsigned long long)lat[callbacks * 99 / 100],
+               (unsigned long long)lat[callbacks - 1],
+               (double)nwrites / callbacks,
+               (double)nallocs / callbacks);
+
+        output->stop();
+    }
+
+    free(lat);
+    output->free();
+    output->plugin.stop();
+    return 0;
+}
@@ -0,0 +1,503 @@
+/*
+    Mock DeaDBeeF API for the PulseAudio output plugin benchmarks
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Only the functions pulse.c calls are filled in. streamer_read produces
+    a sawtooth in whatever format mock_set_format() selected.
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mock_deadbeef.h"
+
+#define MAX_CONF 64
+#define MAX_CLICKS 4096
+#define IEC61937_BURST_FRAMES 1536
+#define IEC61937_PAYLOAD_BYTES 1536
+
+struct conf_item {
+    char key[64];
+    char value[256];
+};
+
+static struct conf_item conf[MAX_CONF];
+static int conf_count;
+static pthread_mutex_t conf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ddb_waveformat_t fmt = { .bps = 16, .channels = 2, .samplerate = 44100, .channelmask = 3 };
+static int read_max;
+static int starved;
+static int read_ragged;
+static int verbose;
+static uint64_t bytes_read;
+static uint32_t phase;
+static float amp = 1.f;
+static int click_period;
+static uint64_t click_frame;
+static uint64_t click_times[MAX_CLICKS];
+static int click_count;
+static int iec_type;
+static uint64_t iec_frame;
+static DB_output_t *switch_output;
+static ddb_waveformat_t switch_fmt;
+static int switch_delay_usec;
+static int switch_state;
+
+static struct conf_item *conf_find(const char *key)
+{
+    for (int i = 0; i < conf_count; i++)
+        if (!strcmp(conf[i].key, key))
+            return &conf[i];
+    return NULL;
+}
+
+void mock_conf_set_str(const char *key, const char *value)
+{
+    pthread_mutex_lock(&conf_mutex);
+    struct conf_item *c = conf_find(key);
+    if (!c && conf_count < MAX_CONF) {
+        c = &conf[conf_count++];
+        snprintf(c->key, sizeof(c->key), "%s", key);
+    }
+    if (c)
+        snprintf(c->value, sizeof(c->value), "%s", value);
+    pthread_mutex_unlock(&conf_mutex);
+}
+
+void mock_conf_set_int(const char *key, int value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", value);
+    mock_conf_set_str(key, buf);
+}
+
+void mock_set_format(const ddb_waveformat_t *f)
+{
+    fmt = *f;
+}
+
+void mock_set_starved(int value)
+{
+    __atomic_store_n(&starved, value, __ATOMIC_RELEASE);
+}
+
+void mock_set_read_max(int bytes)
+{
+    read_max = bytes;
+}
+
+void mock_set_read_ragged(int ragged)
+{
+    read_ragged = ragged;
+}
+
+void mock_set_click_period(int period_frames)
+{
+    click_period = period_frames;
+    click_frame = 0;
+    click_count = 0;
+}
+
+int mock_click_times(const uint64_t **times)
+{
+    *times = click_times;
+    return __atomic_load_n(&click_count, __ATOMIC_ACQUIRE);
+}
+
+void mock_set_iec61937(int data_type)
+{
+    iec_type = data_type;
+    iec_frame = 0;
+}
+
+void mock_set_verbose(int v)
+{
+    verbose = v;
+}
+
+uint64_t mock_bytes_read(void)
+{
+    return __atomic_load_n(&bytes_read, __ATOMIC_RELAXED);
+}
+
+/* Config */
+
+static void conf_lock(void)
+{
+    pthread_mutex_lock(&conf_mutex);
+}
+
+static void conf_unlock(void)
+{
+    pthread_mutex_unlock(&conf_mutex);
+}
+
+static const char *conf_get_str_fast(const char *key, const char *def)
+{
+    struct conf_item *c = conf_find(key);
+    return c ? c->value : def;
+}
+
+static void conf_get_str(const char *key, const char *def, char *buffer, int buffer_size)
+{
+    conf_lock();
+    snprintf(buffer, buffer_size, "%s", conf_get_str_fast(key, def));
+    conf_unlock();
+}
+
+static int conf_get_int(const char *key, int def)
+{
+    conf_lock();
+    struct conf_item *c = conf_find(key);
+    int v = c ? atoi(c->value) : def;
+    conf_unlock();
+    return v;
+}
+
+/* Threads and locks */
+
+struct thread_start_ctx {
+    void (*fn)(void *ctx);
+    void *ctx;
+};
+
+static void *thread_entry(void *p)
+{
+    struct thread_start_ctx ts = *(struct thread_start_ctx *)p;
+    free(p);
+    ts.fn(ts.ctx);
+    return NULL;
+}
+
+static intptr_t thread_start(void (*fn)(void *ctx), void *ctx)
+{
+    pthread_t tid;
+    struct thread_start_ctx *ts = malloc(sizeof(*ts));
+    ts->fn = fn;
+    ts->ctx = ctx;
+    if (pthread_create(&tid, NULL, thread_entry, ts)) {
+        free(ts);
+        return 0;
+    }
+    return (intptr_t)tid;
+}
+
+static int thread_join(intptr_t tid)
+{
+    return pthread_join((pthread_t)tid, NULL);
+}
+
+static int thread_detach(intptr_t tid)
+{
+    return pthread_detach((pthread_t)tid);
+}
+
+static uintptr_t mutex_create(void)
+{
+    pthread_mutex_t *m = malloc(sizeof(*m));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return (uintptr_t)m;
+}
+
+static void mutex_free(uintptr_t mtx)
+{
+    pthread_mutex_destroy((pthread_mutex_t *)mtx);
+    free((void *)mtx);
+}
+
+static uintptr_t cond_create(void)
+{
+    pthread_cond_t *c = malloc(sizeof(*c));
+    pthread_cond_init(c, NULL);
+    return (uintptr_t)c;
+}
+
+static void cond_free(uintptr_t cond)
+{
+    pthread_cond_destroy((pthread_cond_t *)cond);
+    free((void *)cond);
+}
+
+static int cond_wait(uintptr_t cond, uintptr_t mtx)
+{
+    return pthread_cond_wait((pthread_cond_t *)cond, (pthread_mutex_t *)mtx);
+}
+
+static int cond_signal(uintptr_t cond)
+{
+    return pthread_cond_signal((pthread_cond_t *)cond);
+}
+
+static int cond_broadcast(uintptr_t cond)
+{
+    return pthread_cond_broadcast((pthread_cond_t *)cond);
+}
+
+static int mutex_lock(uintptr_t mtx)
+{
+    return pthread_mutex_lock((pthread_mutex_t *)mtx);
+}
+
+static int mutex_unlock(uintptr_t mtx)
+{
+    return pthread_mutex_unlock((pthread_mutex_t *)mtx);
+}
+
+/* Streamer */
+
+static int streamer_ok_to_read(int len)
+{
+    return !__atomic_load_n(&starved, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Silence with a click on every channel each click_period frames */
+static void click_train(char *bytes, int size, int samplesize, int framesize)
+{
+    memset(bytes, 0, size);
+    for (int i = 0; i < size; i += framesize, click_frame++) {
+        if (click_frame % click_period)
+            continue;
+        for (int c = 0; c < framesize; c += samplesize) {
+            if (fmt.is_float) {
+                float f = 1.f;
+                memcpy(bytes + i + c, &f, 4);
+            } else if (samplesize == 1) {
+                bytes[i + c] = (char)0xff;
+            } else {
+                memset(bytes + i + c, 0xff, samplesize - 1);
+                bytes[i + c + samplesize - 1] = 0x7f;
+            }
+        }
+        if (click_count < MAX_CLICKS) {
+            click_times[click_count] = now_usec();
+            __atomic_store_n(&click_count, click_count + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* Pa Pb Pc Pd, payload, zero padding to the next burst */
+static void iec61937_train(char *bytes, int size, int framesize)
+{
+    memset(bytes, 0, size);
+    for (int i = 0; i < size; i += framesize, iec_frame++) {
+        uint32_t pos = iec_frame % IEC61937_BURST_FRAMES;
+        uint16_t w[2];
+
+        if (pos == 0) {
+            w[0] = 0xf872;
+            w[1] = 0x4e1f;
+        } else if (pos == 1) {
+            w[0] = iec_type;
+            w[1] = IEC61937_PAYLOAD_BYTES * 8;
+        } else if (pos < 2 + IEC61937_PAYLOAD_BYTES / 4) {
+            uint32_t v = (uint32_t)iec_frame * 0x01000193;
+            w[0] = v;
+            w[1] = v >> 16;
+        } else {
+            continue;
+        }
+        bytes[i] = w[0];
+        bytes[i + 1] = w[0] >> 8;
+        bytes[i + 2] = w[1];
+        bytes[i + 3] = w[1] >> 8;
+    }
+}
+
+static int streamer_read(char *bytes, int size)
+{
+    if (__atomic_load_n(&switch_state, __ATOMIC_ACQUIRE) == MOCK_SWITCH_ARMED) {
+        // Track change, the real streamer calls setformat from in here
+        __atomic_store_n(&switch_state, MOCK_SWITCH_READING, __ATOMIC_RELEASE);
+        usleep(switch_delay_usec);
+        fmt = switch_fmt;
+        switch_output->setformat(&switch_fmt);
+        __atomic_store_n(&switch_state, MOCK_SWITCH_DONE, __ATOMIC_RELEASE);
+    }
+
+    int samplesize = fmt.bps / 8;
+    int framesize = samplesize * fmt.channels;
+
+    if (read_max && size > read_max)
+        size = read_max;
+    size -= size % framesize;
+    if (read_ragged && size > 1)
+        size--;
+
+    if (iec_type && fmt.bps == 16 && fmt.channels == 2) {
+        iec61937_train(bytes, size, framesize);
+        __atomic_fetch_add(&bytes_read, size, __ATOMIC_RELAXED);
+        return size;
+    }
+
+    if (click_period) {
+        click_train(bytes, size, samplesize, framesize);
+        __atomic_fetch_add(&bytes_read, size, __ATOMIC_RELAXED);
+        return size;
+    }
+
+    for (int i = 0; i < size; i += samplesize) {
+        uint32_t v = phase;
+        phase += 0x01000193;
+        if (fmt.is_float) {
+            float f = (int32_t)v / 2147483648.f;
+            memcpy(bytes + i, &f, 4);
+        } else if (samplesize == 1) {
+            bytes[i] = v >> 24;
+        } else {
+            // little endian, most significant bytes of the sawtooth
+            for (int b = 0; b < samplesize; b++)
+                bytes[i + b] = v >> (8 * (4 - samplesize + b));
+        }
+    }
+
+    __atomic_fetch_add(&bytes_read, size, __ATOMIC_RELAXED);
+    return size;
+}
+
+static DB_playItem_t *streamer_get_playing_track(void)
+{
+    return NULL;
+}
+
+static float volume_get_amp(void)
+{
+    return amp;
+}
+
+static void volume_set_amp(float a)
+{
+    amp = a;
+}
+
+/* Playlist and title formatting, there is never a track */
+
+static void pl_lock(void)
+{
+}
+
+static void pl_unlock(void)
+{
+}
+
+static void pl_item_ref(DB_playItem_t *it)
+{
+}
+
+static void pl_item_unref(DB_playItem_t *it)
+{
+}
+
+static const char *pl_find_meta(DB_playItem_t *it, const char *key)
+{
+    return NULL;
+}
+
+static char *tf_compile(const char *script)
+{
+    return strdup(script);
+}
+
+static void tf_free(char *code)
+{
+    free(code);
+}
+
+static int tf_eval(ddb_tf_context_t *ctx, const char *code, char *out, int outlen)
+{
+    return snprintf(out, outlen, "%s", "Benchmark");
+}
+
+/* Messages and logging */
+
+static int sendmessage(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2)
+{
+    return 0;
+}
+
+static void log_detailed(DB_plugin_t *plugin, uint32_t layers, const char *f, ...)
+{
+    va_list ap;
+
+    if (!verbose)
+        return;
+    va_start(ap, f);
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static DB_functions_t api = {
+    .thread_start = thread_start,
+    .thread_join = thread_join,
+    .thread_detach = thread_detach,
+    .mutex_create = mutex_create,
+    .mutex_free = mutex_free,
+    .mutex_lock = mutex_lock,
+    .mutex_unlock = mutex_unlock,
+    .cond_create = cond_create,
+    .cond_free = cond_free,
+    .cond_wait = cond_wait,
+    .cond_signal = cond_signal,
+    .cond_broadcast = cond_broadcast,
+    .sendmessage = sendmessage,
+    .streamer_read = streamer_read,
+    .streamer_ok_to_read = streamer_ok_to_read,
+    .streamer_get_playing_track = streamer_get_playing_track,
+    .volume_get_amp = volume_get_amp,
+    .volume_set_amp = volume_set_amp,
+    .pl_lock = pl_lock,
+    .pl_unlock = pl_unlock,
+    .pl_item_ref = pl_item_ref,
+    .pl_item_unref = pl_item_unref,
+    .pl_find_meta = pl_find_meta,
+    .conf_lock = conf_lock,
+    .conf_unlock = conf_unlock,
+    .conf_get_str_fast = conf_get_str_fast,
+    .conf_get_str = conf_get_str,
+    .conf_get_int = conf_get_int,
+    .tf_compile = tf_compile,
+    .tf_free = tf_free,
+    .tf_eval = tf_eval,
+    .log_detailed = log_detailed,
+};
+
+void mock_set_format_on_read(DB_output_t *output, const ddb_waveformat_t *f, int delay_usec)
+{
+    switch_output = output;
+    switch_fmt = *f;
+    switch_delay_usec = delay_usec;
+    __atomic_store_n(&switch_state, MOCK_SWITCH_ARMED, __ATOMIC_RELEASE);
+}
+
+int mock_format_on_read_state(void)
+{
+    return __atomic_load_n(&switch_state, __ATOMIC_ACQUIRE);
+}
+
+DB_functions_t *mock_deadbeef_api(void)
+{
+    return &api;
+}
@@ -0,0 +1,68 @@
+/*
+    Mock DeaDBeeF API for the PulseAudio output plugin benchmarks
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef MOCK_DEADBEEF_H
+#define MOCK_DEADBEEF_H
+
+#define DDB_API_LEVEL 10
+#include <deadbeef/deadbeef.h>
+#include <stdint.h>
+
+DB_functions_t *mock_deadbeef_api(void);
+
+/* Integer and string config values, anything not set returns the default */
+void mock_conf_set_int(const char *key, int value);
+void mock_conf_set_str(const char *key, const char *value);
+
+/* Format produced by the synthetic streamer_read */
+void mock_set_format(const ddb_waveformat_t *fmt);
+
+/* streamer_ok_to_read fails while @starved is set, like a stalled network stream */
+void mock_set_starved(int starved);
+
+/* Caps the bytes returned per streamer_read call, 0 for no cap */
+void mock_set_read_max(int bytes);
+
+/* Makes streamer_read return one byte short, so reads end mid frame */
+void mock_set_read_ragged(int ragged);
+
+/*
+ * Switches streamer_read to silence with a full scale click every
+ * period_frames frames, 0 for the default sawtooth. The CLOCK_MONOTONIC
+ * time each click was handed out is recorded.
+ */
+void mock_set_click_period(int period_frames);
+
+/* Number of clicks handed out so far, times in microseconds */
+int mock_click_times(const uint64_t **times);
+
+/*
+ * Switches 16 bit stereo streamer_read to IEC 61937 bursts of @data_type
+ * (1 for AC-3) every 1536 frames with a pseudo-random payload, like an
+ * S/PDIF wav file. 0 turns it off.
+ */
+void mock_set_iec61937(int data_type);
+
+/*
+ * The next streamer_read waits @delay_usec, switches to @fmt and calls
+ * @output's setformat before reading, like the streamer on a track change.
+ */
+void mock_set_format_on_read(DB_output_t *output, const ddb_waveformat_t *fmt, int delay_usec);
+
+enum { MOCK_SWITCH_NONE, MOCK_SWITCH_ARMED, MOCK_SWITCH_READING, MOCK_SWITCH_DONE };
+
+/* Where the change requested by mock_set_format_on_read() is at */
+int mock_format_on_read_state(void);
+
+/* Route plugin log output to stderr */
+void mock_set_verbose(int verbose);
+
+uint64_t mock_bytes_read(void);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+    End-to-end latency benchmark for the PulseAudio output plugin
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Plays a click train through the real plugin (pulse.c linked against
+    libpulse, with the mock DeaDBeeF API providing the audio) into a sink,
+    normally a null sink on a private server started by
+    null_sink_latency.sh, and records the sink's monitor source. The time
+    each click was handed to the plugin is compared with the time it shows
+    up on the monitor to get write-to-output latency and jitter for each
+    pulse2.buffersize.
+*/
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pulse/simple.h>
+#include <pulse/error.h>
+
+#include "mock_deadbeef.h"
+
+#define RATE 48000
+#define CHANNELS 2
+#define FRAGMENT_FRAMES 240
+#define MAX_DETECTED 4096
+
+DB_plugin_t *pulse2_load(DB_functions_t *api);
+
+static const char *server;
+static const char *sink = "bench";
+static pa_simple *rec;
+static int rec_quit;
+static uint64_t detected[MAX_DETECTED];
+static int detected_count;
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *recorder(void *ctx)
+{
+    int16_t buf[FRAGMENT_FRAMES * CHANNELS];
+    int above = 0;
+    int err;
+
+    while (!__atomic_load_n(&rec_quit, __ATOMIC_ACQUIRE)) {
+        if (pa_simple_read(rec, buf, sizeof(buf), &err) < 0) {
+            fprintf(stderr, "record: %s\n", pa_strerror(err));
+            break;
+        }
+
+        // Capture time of the last frame we just got
+        uint64_t t = now_usec() - pa_simple_get_latency(rec, &err);
+
+        for (int i = 0; i < FRAGMENT_FRAMES; i++) {
+            int loud = abs(buf[i * CHANNELS]) > 16384;
+            if (loud && !above && detected_count < MAX_DETECTED) {
+                detected[detected_count++] = t - (uint64_t)(FRAGMENT_FRAMES - 1 - i) * 1000000 / RATE;
+            }
+            above = loud;
+        }
+    }
+    return NULL;
+}
+
+static int open_recorder(void)
+{
+    char monitor[256];
+    int err;
+    pa_sample_spec ss = { .format = PA_SAMPLE_S16LE, .rate = RATE, .channels = CHANNELS };
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t) -1,
+        .fragsize = FRAGMENT_FRAMES * CHANNELS * 2,
+    };
+
+    snprintf(monitor, sizeof(monitor), "%s.monitor", sink);
+    rec = pa_simple_new(server, "ddb_output_pulse2 latency", PA_STREAM_RECORD, monitor,
+            "monitor", &ss, NULL, &attr, &err);
+    if (!rec) {
+        fprintf(stderr, "cannot record %s: %s\n", monitor, pa_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-s server] [-d sink] [-b buffer_ms,...] [-l seconds] [-p click_ms]\n"
+            "          [-t tolerance_ms] [-v]\n"
+            "  -t  fail if mean latency exceeds the buffer size by more than this\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    char buffers[256] = "20,50,100,200,500";
+    int seconds = 5;
+    int click_ms = 250;
+    int tolerance = 0;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:b:l:p:t:vh")) != -1) {
+        switch (opt) {
+        case 's': server = optarg; break;
+        case 'd': sink = optarg; break;
+        case 'b': snprintf(buffers, sizeof(buffers), "%s", optarg); break;
+        case 'l': seconds = atoi(optarg); break;
+        case 'p': click_ms = atoi(optarg); break;
+        case 't': tolerance = atoi(optarg); break;
+        case 'v': mock_set_verbose(1); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (seconds < 1 || click_ms < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (server) {
+        mock_conf_set_str("pulse2.serveraddr", server);
+    }
+    mock_conf_set_str("pulseaudio2_soundcard", sink);
+
+    DB_output_t *output = (DB_output_t *)pulse2_load(mock_deadbeef_api());
+    output->plugin.start();
+
+    ddb_waveformat_t fmt = {
+        .bps = 16,
+        .channels = CHANNELS,
+        .samplerate = RATE,
+        .channelmask = 3,
+    };
+    mock_set_format(&fmt);
+
+    printf("sink %s, %d ms click period, %d s per buffer size\n", sink, click_ms, seconds);
+    printf("%10s %8s %10s %10s %10s %10s\n", "buffer ms", "clicks", "mean ms", "min ms", "max ms", "jitter ms");
+
+    for (char *tok = strtok(buffers, ","); tok; tok = strtok(NULL, ",")) {
+        int buffer_ms = atoi(tok);
+        pthread_t tid;
+
+        if (open_recorder() < 0) {
+            return 1;
+        }
+        detected_count = 0;
+        rec_quit = 0;
+        pthread_create(&tid, NULL, recorder, NULL);
+        usleep(200000);
+
+        mock_conf_set_int("pulse2.buffersize", buffer_ms);
+        mock_set_click_period(RATE * click_ms / 1000);
+        output->setformat(&fmt);
+        if (output->play() < 0) {
+            fprintf(stderr, "play failed\n");
+            return 1;
+        }
+
+        sleep(seconds);
+        output->stop();
+
+        // Let the last clicks that made it to the sink come through
+        usleep(200000 + buffer_ms * 1000);
+        __atomic_store_n(&rec_quit, 1, __ATOMIC_RELEASE);
+        pthread_join(tid, NULL);
+        pa_simple_free(rec);
+        rec = NULL;
+
+        const uint64_t *written;
+        int nwritten = mock_click_times(&written);
+        int n = nwritten < detected_count ? nwritten : detected_count;
+        double sum = 0, sq = 0, min = 1e9, max = 0;
+
+        for (int i = 0; i < n; i++) {
+            double ms = ((double)detected[i] - (double)written[i]) / 1000.0;
+            sum += ms;
+            sq += ms * ms;
+            if (ms < min) min = ms;
+            if (ms > max) max = ms;
+        }
+
+        if (!n) {
+            printf("%10d %8d %10s %10s %10s %10s\n", buffer_ms, 0, "-", "-", "-", "-");
+            failed = 1;
+            continue;
+        }
+
+        double mean = sum / n;
+        double jitter = sqrt(sq / n - mean * mean);
+        printf("%10d %8d %10.1f %10.1f %10.1f %10.2f\n", buffer_ms, n, mean, min, max, jitter);
+
+        if (tolerance > 0 && mean > buffer_ms + tolerance) {
+            fprintf(stderr, "buffer %d ms: mean latency %.1f ms exceeds tolerance\n", buffer_ms, mean);
+            failed = 1;
+        }
+    }
+
+    output->free();
+    output->plugin.stop();
+    return failed;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs the null_sink_latency benchmark (or passthrough_fallback) against a
+# private PulseAudio daemon with a null sink, so it works on machines without
+# audio hardware. NULL_SINK_ARGS is appended to the null sink's arguments,
+# e.g. 'formats=ac3-iec61937;pcm' for a sink that accepts AC-3 passthrough.
+#
+#   null_sink_latency.sh path/to/null_sink_latency [benchmark args...]
+#
+# Set PULSE_BENCH_SERVER to use an already running server instead (for
+# example pipewire-pulse); it must have a sink called "bench". Without either
+# it exits 77, which meson test reports as skipped.
+
+set -e
+
+exe="$1"
+shift
+
+if [ -n "$PULSE_BENCH_SERVER" ]; then
+    exec "$exe" -s "$PULSE_BENCH_SERVER" "$@"
+fi
+
+if ! command -v pulseaudio >/dev/null 2>&1; then
+    echo "pulseaudio not found, skipping" >&2
+    exit 77
+fi
+
+runtime=$(mktemp -d)
+trap 'kill "$pid" 2>/dev/null; wait "$pid" 2>/dev/null; rm -rf "$runtime"' EXIT INT TERM
+
+PULSE_RUNTIME_PATH="$runtime" PULSE_STATE_PATH="$runtime" HOME="$runtime" \
+    pulseaudio -n --daemonize=no --exit-idle-time=-1 --use-pid-file=no \
+    --disable-shm=yes --log-target=stderr --log-level=error \
+    -L "module-native-protocol-unix auth-anonymous=1 socket=$runtime/native" \
+    -L "module-null-sink sink_name=bench rate=48000 ${NULL_SINK_ARGS}" &
+pid=$!
+
+i=0
+while [ ! -S "$runtime/native" ]; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+        echo "pulseaudio did not start" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+"$exe" -s "unix:$runtime/native" -d bench "$@"
@@ -0,0 +1,157 @@
+/*
+    IEC 61937 passthrough check for the PulseAudio output plugin
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Plays an AC-3 burst train through the real plugin with
+    pulse2.passthrough on, then asks the server which format the plugin's
+    sink input ended up with. Run through null_sink_latency.sh with
+    NULL_SINK_ARGS='formats=ac3-iec61937;pcm' and -e ac3-iec61937 to check
+    passthrough, or with a plain null sink and -e pcm to check the PCM
+    fallback. Exits non-zero if the format is not the expected one.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pulse/pulseaudio.h>
+
+#include "mock_deadbeef.h"
+
+#define RATE 48000
+
+DB_plugin_t *pulse2_load(DB_functions_t *api);
+
+static const char *server;
+static const char *sink = "bench";
+static char found[64];
+
+static void context_state_cb(pa_context *c, void *userdata)
+{
+    pa_threaded_mainloop_signal(userdata, 0);
+}
+
+static void sink_input_cb(pa_context *c, const pa_sink_input_info *i, int eol, void *userdata)
+{
+    if (eol) {
+        pa_threaded_mainloop_signal(userdata, 0);
+        return;
+    }
+    if (i->format && !found[0]) {
+        snprintf(found, sizeof(found), "%s", pa_encoding_to_string(i->format->encoding));
+    }
+}
+
+/* Encoding of the first sink input on the server, "" if there is none */
+static int query_format(void)
+{
+    pa_threaded_mainloop *ml = pa_threaded_mainloop_new();
+    pa_context *ctx = pa_context_new(pa_threaded_mainloop_get_api(ml), "passthrough check");
+    int rc = -1;
+
+    pa_context_set_state_callback(ctx, context_state_cb, ml);
+    pa_threaded_mainloop_lock(ml);
+    pa_threaded_mainloop_start(ml);
+    if (pa_context_connect(ctx, server, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        goto out;
+    }
+    for (;;) {
+        pa_context_state_t s = pa_context_get_state(ctx);
+        if (s == PA_CONTEXT_READY)
+            break;
+        if (!PA_CONTEXT_IS_GOOD(s))
+            goto out;
+        pa_threaded_mainloop_wait(ml);
+    }
+
+    pa_operation *o = pa_context_get_sink_input_info_list(ctx, sink_input_cb, ml);
+    while (pa_operation_get_state(o) == PA_OPERATION_RUNNING) {
+        pa_threaded_mainloop_wait(ml);
+    }
+    pa_operation_unref(o);
+    rc = 0;
+
+out:
+    if (rc < 0) {
+        fprintf(stderr, "cannot query the server: %s\n", pa_strerror(pa_context_errno(ctx)));
+    }
+    pa_context_disconnect(ctx);
+    pa_threaded_mainloop_unlock(ml);
+    pa_threaded_mainloop_stop(ml);
+    pa_context_unref(ctx);
+    pa_threaded_mainloop_free(ml);
+    return rc;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-s server] [-d sink] [-e expected_encoding] [-v]\n"
+            "  -e  ac3-iec61937 when the sink accepts AC-3, pcm (default) when it does not\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *expected = "pcm";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:e:vh")) != -1) {
+        switch (opt) {
+        case 's': server = optarg; break;
+        case 'd': sink = optarg; break;
+        case 'e': expected = optarg; break;
+        case 'v': mock_set_verbose(1); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (server) {
+        mock_conf_set_str("pulse2.serveraddr", server);
+    }
+    mock_conf_set_str("pulseaudio2_soundcard", sink);
+    mock_conf_set_int("pulse2.passthrough", 1);
+
+    DB_output_t *output = (DB_output_t *)pulse2_load(mock_deadbeef_api());
+    output->plugin.start();
+
+    ddb_waveformat_t fmt = {
+        .bps = 16,
+        .channels = 2,
+        .samplerate = RATE,
+        .channelmask = 3,
+    };
+    mock_set_format(&fmt);
+    mock_set_iec61937(1);
+
+    output->setformat(&fmt);
+    if (output->play() < 0) {
+        fprintf(stderr, "play failed\n");
+        return 1;
+    }
+
+    // Probe, switch and a little playback on the new stream
+    sleep(2);
+    uint64_t before = mock_bytes_read();
+    sleep(1);
+    uint64_t played = mock_bytes_read() - before;
+
+    int rc = query_format();
+    output->stop();
+    output->free();
+    output->plugin.stop();
+    if (rc < 0) {
+        return 1;
+    }
+
+    printf("sink %s, sink input format %s, expected %s, %llu bytes in the last second\n",
+           sink, found[0] ? found : "-", expected, (unsigned long long)played);
+    return strcmp(found, expected) || !played;
+}
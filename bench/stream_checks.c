@@ -0,0 +1,213 @@
+/*
+    Regression checks for the PulseAudio output plugin
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Links pulse.c against the stub libpulse and the mock DeaDBeeF API like
+    bench_pulse, but plays out sequences that used to hang or lose audio
+    and fails if they still do. Each check gets CHECK_TIMEOUT_S seconds, a
+    deadlock ends the run through SIGALRM.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mock_deadbeef.h"
+#include "stub_pulse.h"
+
+#define CHECK_TIMEOUT_S 10
+
+DB_plugin_t *pulse2_load(DB_functions_t *api);
+
+static DB_output_t *output;
+
+static const ddb_waveformat_t fmt_cd = {
+    .bps = 16, .channels = 2, .samplerate = 44100, .channelmask = 3,
+};
+
+static const ddb_waveformat_t fmt_hires = {
+    .bps = 24, .channels = 2, .samplerate = 96000, .channelmask = 3,
+};
+
+static int play(const ddb_waveformat_t *fmt)
+{
+    mock_set_format(fmt);
+    output->setformat((ddb_waveformat_t *)fmt);
+    return output->play() < 0 || !stub_last_stream() ? -1 : 0;
+}
+
+/* The streamer calls setformat from streamer_read on the prefetch thread while stop joins that thread */
+static int check_setformat_during_stop(void)
+{
+    mock_conf_set_int("pulse2.prefetch", 100);
+    if (play(&fmt_cd) < 0) {
+        return -1;
+    }
+    // Armed first, the producer may have filled the ring and wait for this request to read again
+    mock_set_format_on_read(output, &fmt_hires, 100000);
+    stub_stream_request(stub_last_stream(), 17640);
+    while (mock_format_on_read_state() != MOCK_SWITCH_READING) {
+        usleep(1000);
+    }
+    output->stop();
+    mock_conf_set_int("pulse2.prefetch", 0);
+    return mock_format_on_read_state() == MOCK_SWITCH_DONE ? 0 : -1;
+}
+
+/* The server asks a paused (corked) stream for data after a format change, then playback resumes */
+static int check_switch_while_paused(void)
+{
+    pa_stream *s, *n;
+
+    if (play(&fmt_cd) < 0) {
+        return -1;
+    }
+    s = stub_last_stream();
+    stub_stream_request(s, 17640);
+    output->pause();
+    mock_set_format(&fmt_hires);
+    output->setformat((ddb_waveformat_t *)&fmt_hires);
+    stub_stream_request(s, 4410);
+    output->unpause();
+
+    n = stub_last_stream();
+    if (n == s || stub_stream_corked(n)) {
+        return -1;
+    }
+    uint64_t bytes = stub_stream_bytes(n);
+    stub_stream_request(n, 28800);
+    return stub_stream_bytes(n) > bytes ? 0 : -1;
+}
+
+/* A stalled streamer corks the stream and its fan-out streams after the idle timeout, data uncorks them all */
+static int check_autocork_fanout(void)
+{
+    pa_stream *s;
+    int rc = -1;
+
+    mock_conf_set_int("pulse2.autocork", 100);
+    mock_conf_set_str("pulse2.fanout", "hdmi, net");
+    if (play(&fmt_cd) < 0) {
+        goto out;
+    }
+    s = stub_stream_oldest();
+    stub_stream_request(s, 17640);
+    if (stub_streams_playing() != 3) {
+        goto out;
+    }
+
+    mock_set_starved(1);
+    stub_stream_request(s, 35280);
+    stub_timers_run(200000);
+    if (stub_streams_playing() != 0) {
+        goto out;
+    }
+
+    mock_set_starved(0);
+    stub_timers_run(200000);
+    uint64_t bytes = stub_stream_bytes(s);
+    stub_stream_request(s, 17640);
+    rc = stub_streams_playing() == 3 && stub_stream_bytes(s) > bytes ? 0 : -1;
+out:
+    mock_set_starved(0);
+    mock_conf_set_str("pulse2.fanout", "");
+    mock_conf_set_int("pulse2.autocork", 0);
+    return rc;
+}
+
+/* With the prefetch ring the producer uncorks as soon as the streamer has data again */
+static int check_autocork_prefetch(void)
+{
+    pa_stream *s;
+    int rc = -1;
+
+    mock_conf_set_int("pulse2.autocork", 100);
+    mock_conf_set_int("pulse2.prefetch", 100);
+    if (play(&fmt_cd) < 0) {
+        goto out;
+    }
+    s = stub_last_stream();
+    mock_set_starved(1);
+    stub_stream_request(s, 70560);
+    stub_timers_run(200000);
+    if (stub_streams_playing() != 0) {
+        goto out;
+    }
+
+    mock_set_starved(0);
+    while (stub_streams_playing() != 1) {
+        usleep(1000);
+    }
+    rc = 0;
+out:
+    mock_set_starved(0);
+    mock_conf_set_int("pulse2.prefetch", 0);
+    mock_conf_set_int("pulse2.autocork", 0);
+    return rc;
+}
+
+/* Streamer reads that end mid frame still reach the stream and its fan-out streams as whole frames */
+static int check_ragged_reads(void)
+{
+    pa_stream *s, *fan;
+    uint64_t errors = stub_write_errors();
+    int rc = -1;
+
+    mock_set_read_ragged(1);
+    mock_conf_set_str("pulse2.fanout", "hdmi");
+    if (play(&fmt_cd) < 0) {
+        goto out;
+    }
+    s = stub_stream_oldest();
+    fan = stub_last_stream();
+    for (int i = 0; i < 20; i++) {
+        stub_stream_request(s, 17640);
+        stub_stream_request(fan, 17640);
+    }
+    rc = stub_write_errors() == errors && stub_stream_bytes(s) && stub_stream_bytes(fan) ? 0 : -1;
+out:
+    mock_conf_set_str("pulse2.fanout", "");
+    mock_set_read_ragged(0);
+    return rc;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(void);
+} checks[] = {
+    { "setformat from streamer_read during stop", check_setformat_during_stop },
+    { "format switch while paused", check_switch_while_paused },
+    { "idle cork with fan-out", check_autocork_fanout },
+    { "idle cork with prefetch", check_autocork_prefetch },
+    { "streamer reads ending mid frame", check_ragged_reads },
+};
+
+int main(int argc, char **argv)
+{
+    int failed = 0;
+
+    // Keep what passed when SIGALRM ends the run
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    output = (DB_output_t *)pulse2_load(mock_deadbeef_api());
+    output->plugin.start();
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        alarm(CHECK_TIMEOUT_S);
+        int rc = checks[i].fn();
+        alarm(0);
+        output->stop();
+        printf("%s: %s\n", rc < 0 ? "FAIL" : "ok", checks[i].name);
+        failed += rc < 0;
+    }
+
+    output->free();
+    output->plugin.stop();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,998 @@
+/*
+    Stub libpulse for the PulseAudio output plugin benchmarks
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Implements just enough of the client API for pulse.c to run without a
+    server: state changes complete synchronously in the calling thread,
+    operations are done as soon as they are created, timers only fire from
+    stub_timers_run() and written audio is counted and discarded. Like the
+    server, a corked stream does not drain until it is uncorked, and
+    writes that are not whole frames are rejected.
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "stub_pulse.h"
+
+struct pa_threaded_mainloop {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pa_mainloop_api api;
+};
+
+struct pa_mainloop {
+    pa_mainloop_api api;
+};
+
+struct pa_time_event {
+    pa_time_event_cb_t cb;
+    void *userdata;
+    struct timeval tv;
+    unsigned run;
+    pa_time_event *next;
+};
+
+struct pa_operation {
+    int refs;
+    pa_operation_state_t state;
+};
+
+struct pa_context {
+    int refs;
+    pa_context_state_t state;
+    pa_context_notify_cb_t state_cb;
+    void *state_userdata;
+    pa_context_subscribe_cb_t subscribe_cb;
+    void *subscribe_userdata;
+};
+
+struct pa_stream {
+    int refs;
+    pa_context *ctx;
+    pa_stream_state_t state;
+    int corked;
+    pa_sample_spec ss;
+    pa_buffer_attr attr;
+    char *wbuf;
+    uint64_t writes;
+    uint64_t bytes;
+    pa_stream_notify_cb_t state_cb;
+    void *state_userdata;
+    pa_stream_request_cb_t write_cb;
+    void *write_userdata;
+    pa_format_info *format;
+    pa_operation *drain_op;
+    pa_stream_success_cb_t drain_cb;
+    void *drain_userdata;
+    pa_stream *next;
+};
+
+/* pa_format_info with the properties the stub cares about */
+struct stub_format {
+    pa_format_info info;
+    pa_sample_spec ss;
+};
+
+struct prop {
+    char *key;
+    char *value;
+    struct prop *next;
+};
+
+struct pa_proplist {
+    struct prop *head;
+};
+
+static pa_threaded_mainloop *stub_ml;
+static pa_stream *last_stream;
+static pa_stream *streams;
+static pa_time_event *timers;
+static unsigned timers_run;
+static uint64_t write_errors;
+
+/* Operations */
+
+static pa_operation *op_new(void)
+{
+    pa_operation *o = calloc(1, sizeof(*o));
+    o->refs = 1;
+    o->state = PA_OPERATION_DONE;
+    return o;
+}
+
+pa_operation_state_t pa_operation_get_state(const pa_operation *o)
+{
+    return o->state;
+}
+
+void pa_operation_cancel(pa_operation *o)
+{
+    if (o->state == PA_OPERATION_RUNNING)
+        o->state = PA_OPERATION_CANCELLED;
+}
+
+void pa_operation_unref(pa_operation *o)
+{
+    if (--o->refs == 0)
+        free(o);
+}
+
+/* Errors and time */
+
+const char *pa_strerror(int error)
+{
+    return "stub error";
+}
+
+pa_usec_t pa_rtclock_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (pa_usec_t)ts.tv_sec * PA_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+struct timeval *pa_gettimeofday(struct timeval *tv)
+{
+    gettimeofday(tv, NULL);
+    return tv;
+}
+
+struct timeval *pa_timeval_add(struct timeval *tv, pa_usec_t v)
+{
+    v += tv->tv_usec;
+    tv->tv_sec += v / PA_USEC_PER_SEC;
+    tv->tv_usec = v % PA_USEC_PER_SEC;
+    return tv;
+}
+
+/* Sample specs and volumes */
+
+static size_t sample_size(pa_sample_format_t f)
+{
+    switch (f) {
+    case PA_SAMPLE_U8:
+    case PA_SAMPLE_ALAW:
+    case PA_SAMPLE_ULAW:
+        return 1;
+    case PA_SAMPLE_S16LE:
+    case PA_SAMPLE_S16BE:
+        return 2;
+    case PA_SAMPLE_S24LE:
+    case PA_SAMPLE_S24BE:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+const char *pa_sample_format_to_string(pa_sample_format_t f)
+{
+    static const char *names[PA_SAMPLE_MAX] = {
+        [PA_SAMPLE_U8] = "u8", [PA_SAMPLE_ALAW] = "aLaw", [PA_SAMPLE_ULAW] = "uLaw",
+        [PA_SAMPLE_S16LE] = "s16le", [PA_SAMPLE_S16BE] = "s16be",
+        [PA_SAMPLE_FLOAT32LE] = "float32le", [PA_SAMPLE_FLOAT32BE] = "float32be",
+        [PA_SAMPLE_S32LE] = "s32le", [PA_SAMPLE_S32BE] = "s32be",
+        [PA_SAMPLE_S24LE] = "s24le", [PA_SAMPLE_S24BE] = "s24be",
+        [PA_SAMPLE_S24_32LE] = "s24-32le", [PA_SAMPLE_S24_32BE] = "s24-32be",
+    };
+    return f >= 0 && f < PA_SAMPLE_MAX ? names[f] : NULL;
+}
+
+size_t pa_frame_size(const pa_sample_spec *spec)
+{
+    return sample_size(spec->format) * spec->channels;
+}
+
+size_t pa_usec_to_bytes(pa_usec_t t, const pa_sample_spec *spec)
+{
+    return (size_t)(t * spec->rate / PA_USEC_PER_SEC) * pa_frame_size(spec);
+}
+
+pa_usec_t pa_bytes_to_usec(uint64_t length, const pa_sample_spec *spec)
+{
+    return length / pa_frame_size(spec) * PA_USEC_PER_SEC / spec->rate;
+}
+
+pa_channel_map *pa_channel_map_init_extend(pa_channel_map *m, unsigned channels, pa_channel_map_def_t def)
+{
+    memset(m, 0, sizeof(*m));
+    m->channels = channels;
+    return m;
+}
+
+pa_cvolume *pa_cvolume_set(pa_cvolume *a, unsigned channels, pa_volume_t v)
+{
+    a->channels = channels;
+    for (unsigned i = 0; i < channels; i++)
+        a->values[i] = v;
+    return a;
+}
+
+int pa_cvolume_equal(const pa_cvolume *a, const pa_cvolume *b)
+{
+    return a->channels == b->channels
+        && !memcmp(a->values, b->values, a->channels * sizeof(a->values[0]));
+}
+
+pa_volume_t pa_cvolume_avg(const pa_cvolume *a)
+{
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < a->channels; i++)
+        sum += a->values[i];
+    return a->channels ? sum / a->channels : 0;
+}
+
+pa_volume_t pa_sw_volume_from_linear(double v)
+{
+    return (pa_volume_t)(cbrt(v) * PA_VOLUME_NORM);
+}
+
+double pa_sw_volume_to_linear(pa_volume_t v)
+{
+    double f = (double)v / PA_VOLUME_NORM;
+    return f * f * f;
+}
+
+/* Property lists */
+
+pa_proplist *pa_proplist_new(void)
+{
+    return calloc(1, sizeof(pa_proplist));
+}
+
+static struct prop *prop_find(const pa_proplist *p, const char *key)
+{
+    for (struct prop *i = p->head; i; i = i->next)
+        if (!strcmp(i->key, key))
+            return i;
+    return NULL;
+}
+
+int pa_proplist_sets(pa_proplist *p, const char *key, const char *value)
+{
+    struct prop *i;
+
+    if (!key || !value)
+        return -1;
+
+    i = prop_find(p, key);
+    if (i) {
+        free(i->value);
+    } else {
+        i = calloc(1, sizeof(*i));
+        i->key = strdup(key);
+        i->next = p->head;
+        p->head = i;
+    }
+    i->value = strdup(value);
+    return 0;
+}
+
+void pa_proplist_update(pa_proplist *p, pa_update_mode_t mode, const pa_proplist *other)
+{
+    for (struct prop *i = other->head; i; i = i->next)
+        if (mode != PA_UPDATE_SET || !prop_find(p, i->key))
+            pa_proplist_sets(p, i->key, i->value);
+}
+
+int pa_proplist_unset(pa_proplist *p, const char *key)
+{
+    for (struct prop **i = &p->head; *i; i = &(*i)->next) {
+        if (!strcmp((*i)->key, key)) {
+            struct prop *n = *i;
+            *i = n->next;
+            free(n->key);
+            free(n->value);
+            free(n);
+            return 0;
+        }
+    }
+    return -PA_ERR_NOENTITY;
+}
+
+pa_proplist *pa_proplist_copy(const pa_proplist *p)
+{
+    pa_proplist *copy = pa_proplist_new();
+    pa_proplist_update(copy, PA_UPDATE_REPLACE, p);
+    return copy;
+}
+
+void pa_proplist_free(pa_proplist *p)
+{
+    struct prop *i = p->head;
+    while (i) {
+        struct prop *next = i->next;
+        free(i->key);
+        free(i->value);
+        free(i);
+        i = next;
+    }
+    free(p);
+}
+
+/* Mainloops */
+
+static pa_time_event *stub_time_new(pa_mainloop_api *a, const struct timeval *tv, pa_time_event_cb_t cb, void *userdata)
+{
+    pa_time_event *e = calloc(1, sizeof(*e));
+    e->cb = cb;
+    e->userdata = userdata;
+    if (tv)
+        e->tv = *tv;
+    // Not due in a stub_timers_run() that is already going on
+    e->run = timers_run;
+    e->next = timers;
+    timers = e;
+    return e;
+}
+
+static void stub_time_restart(pa_time_event *e, const struct timeval *tv)
+{
+    e->tv = *tv;
+}
+
+static void stub_time_free(pa_time_event *e)
+{
+    pa_time_event **p = &timers;
+
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    free(e);
+}
+
+static void stub_api_init(pa_mainloop_api *api)
+{
+    memset(api, 0, sizeof(*api));
+    api->time_new = stub_time_new;
+    api->time_restart = stub_time_restart;
+    api->time_free = stub_time_free;
+}
+
+pa_threaded_mainloop *pa_threaded_mainloop_new(void)
+{
+    pa_threaded_mainloop *m = calloc(1, sizeof(*m));
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&m->cond, NULL);
+    stub_api_init(&m->api);
+    stub_ml = m;
+    return m;
+}
+
+int pa_threaded_mainloop_start(pa_threaded_mainloop *m)
+{
+    return 0;
+}
+
+void pa_threaded_mainloop_stop(pa_threaded_mainloop *m)
+{
+}
+
+void pa_threaded_mainloop_free(pa_threaded_mainloop *m)
+{
+    if (stub_ml == m)
+        stub_ml = NULL;
+    pthread_mutex_destroy(&m->mutex);
+    pthread_cond_destroy(&m->cond);
+    free(m);
+}
+
+void pa_threaded_mainloop_lock(pa_threaded_mainloop *m)
+{
+    pthread_mutex_lock(&m->mutex);
+}
+
+void pa_threaded_mainloop_unlock(pa_threaded_mainloop *m)
+{
+    pthread_mutex_unlock(&m->mutex);
+}
+
+void pa_threaded_mainloop_wait(pa_threaded_mainloop *m)
+{
+    // Nothing completes asynchronously here, so never block for long
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&m->cond, &m->mutex, &ts);
+}
+
+int pa_threaded_mainloop_in_thread(pa_threaded_mainloop *m)
+{
+    /* There is no mainloop thread, callbacks run on the caller's */
+    return 0;
+}
+
+void pa_threaded_mainloop_signal(pa_threaded_mainloop *m, int wait_for_accept)
+{
+    pthread_cond_broadcast(&m->cond);
+}
+
+pa_mainloop_api *pa_threaded_mainloop_get_api(pa_threaded_mainloop *m)
+{
+    return &m->api;
+}
+
+pa_mainloop *pa_mainloop_new(void)
+{
+    pa_mainloop *m = calloc(1, sizeof(*m));
+    stub_api_init(&m->api);
+    return m;
+}
+
+void pa_mainloop_free(pa_mainloop *m)
+{
+    free(m);
+}
+
+pa_mainloop_api *pa_mainloop_get_api(pa_mainloop *m)
+{
+    return &m->api;
+}
+
+int pa_mainloop_run(pa_mainloop *m, int *retval)
+{
+    // No server to talk to
+    return -1;
+}
+
+void pa_mainloop_quit(pa_mainloop *m, int retval)
+{
+}
+
+/* Contexts */
+
+static void context_set_state(pa_context *c, pa_context_state_t st)
+{
+    c->state = st;
+    if (c->state_cb)
+        c->state_cb(c, c->state_userdata);
+}
+
+pa_context *pa_context_new(pa_mainloop_api *mainloop, const char *name)
+{
+    pa_context *c = calloc(1, sizeof(*c));
+    c->refs = 1;
+    c->state = PA_CONTEXT_UNCONNECTED;
+    return c;
+}
+
+pa_context *pa_context_new_with_proplist(pa_mainloop_api *mainloop, const char *name, const pa_proplist *proplist)
+{
+    return pa_context_new(mainloop, name);
+}
+
+void pa_context_unref(pa_context *c)
+{
+    if (--c->refs == 0)
+        free(c);
+}
+
+void pa_context_set_state_callback(pa_context *c, pa_context_notify_cb_t cb, void *userdata)
+{
+    c->state_cb = cb;
+    c->state_userdata = userdata;
+}
+
+void pa_context_set_subscribe_callback(pa_context *c, pa_context_subscribe_cb_t cb, void *userdata)
+{
+    c->subscribe_cb = cb;
+    c->subscribe_userdata = userdata;
+}
+
+int pa_context_errno(const pa_context *c)
+{
+    return 0;
+}
+
+pa_context_state_t pa_context_get_state(const pa_context *c)
+{
+    return c->state;
+}
+
+int pa_context_connect(pa_context *c, const char *server, pa_context_flags_t flags, const pa_spawn_api *api)
+{
+    context_set_state(c, PA_CONTEXT_CONNECTING);
+    context_set_state(c, PA_CONTEXT_READY);
+    return 0;
+}
+
+void pa_context_disconnect(pa_context *c)
+{
+    context_set_state(c, PA_CONTEXT_TERMINATED);
+}
+
+pa_operation *pa_context_subscribe(pa_context *c, pa_subscription_mask_t m, pa_context_success_cb_t cb, void *userdata)
+{
+    if (cb)
+        cb(c, 1, userdata);
+    return op_new();
+}
+
+/* A single always-present sink */
+static void stub_sink_info(pa_sink_info *i)
+{
+    memset(i, 0, sizeof(*i));
+    i->name = "stub";
+    i->index = 0;
+    i->description = "Stub sink";
+    i->sample_spec.format = PA_SAMPLE_S16LE;
+    i->sample_spec.rate = 44100;
+    i->sample_spec.channels = 2;
+    pa_channel_map_init_extend(&i->channel_map, 2, PA_CHANNEL_MAP_DEFAULT);
+}
+
+pa_operation *pa_context_get_sink_info_list(pa_context *c, pa_sink_info_cb_t cb, void *userdata)
+{
+    pa_sink_info i;
+
+    stub_sink_info(&i);
+    cb(c, &i, 0, userdata);
+    cb(c, NULL, 1, userdata);
+    return op_new();
+}
+
+pa_operation *pa_context_get_sink_info_by_index(pa_context *c, uint32_t idx, pa_sink_info_cb_t cb, void *userdata)
+{
+    pa_sink_info i;
+
+    stub_sink_info(&i);
+    if (idx == i.index)
+        cb(c, &i, 0, userdata);
+    cb(c, NULL, 1, userdata);
+    return op_new();
+}
+
+pa_operation *pa_context_get_server_info(pa_context *c, pa_server_info_cb_t cb, void *userdata)
+{
+    pa_server_info i;
+
+    memset(&i, 0, sizeof(i));
+    i.default_sink_name = "stub";
+    cb(c, &i, userdata);
+    return op_new();
+}
+
+pa_operation *pa_context_move_sink_input_by_name(pa_context *c, uint32_t idx, const char *sink_name, pa_context_success_cb_t cb, void *userdata)
+{
+    if (cb)
+        cb(c, !strcmp(sink_name, "stub"), userdata);
+    return op_new();
+}
+
+pa_operation *pa_context_get_sink_input_info(pa_context *c, uint32_t idx, pa_sink_input_info_cb_t cb, void *userdata)
+{
+    cb(c, NULL, 1, userdata);
+    return op_new();
+}
+
+pa_operation *pa_context_set_sink_input_volume(pa_context *c, uint32_t idx, const pa_cvolume *volume, pa_context_success_cb_t cb, void *userdata)
+{
+    if (cb)
+        cb(c, 1, userdata);
+    return op_new();
+}
+
+/* Streams */
+
+static void stream_set_state(pa_stream *s, pa_stream_state_t st)
+{
+    s->state = st;
+    if (s->state_cb)
+        s->state_cb(s, s->state_userdata);
+}
+
+pa_stream *pa_stream_new_with_proplist(pa_context *c, const char *name, const pa_sample_spec *ss, const pa_channel_map *map, pa_proplist *p)
+{
+    pa_stream *s = calloc(1, sizeof(*s));
+    s->refs = 1;
+    s->ctx = c;
+    s->ss = *ss;
+    s->state = PA_STREAM_UNCONNECTED;
+    s->wbuf = malloc(STUB_BLOCK_SIZE);
+    s->next = streams;
+    streams = s;
+    last_stream = s;
+    return s;
+}
+
+/* The stub sink only plays PCM, so this takes the first PCM format offered */
+pa_stream *pa_stream_new_extended(pa_context *c, const char *name, pa_format_info * const *formats, unsigned int n_formats, pa_proplist *p)
+{
+    for (unsigned int i = 0; i < n_formats; i++) {
+        if (!pa_format_info_is_pcm(formats[i]))
+            continue;
+        struct stub_format *f = (struct stub_format *)formats[i];
+        pa_stream *s = pa_stream_new_with_proplist(c, name, &f->ss, NULL, p);
+        s->format = pa_format_info_new();
+        *(struct stub_format *)s->format = *f;
+        return s;
+    }
+    return NULL;
+}
+
+pa_stream *pa_stream_ref(pa_stream *s)
+{
+    s->refs++;
+    return s;
+}
+
+static void stream_drain_end(pa_stream *s, int done);
+
+void pa_stream_unref(pa_stream *s)
+{
+    if (--s->refs)
+        return;
+    stream_drain_end(s, 0);
+    if (last_stream == s)
+        last_stream = NULL;
+    for (pa_stream **p = &streams; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    pa_format_info_free(s->format);
+    free(s->wbuf);
+    free(s);
+}
+
+pa_stream_state_t pa_stream_get_state(const pa_stream *p)
+{
+    return p->state;
+}
+
+uint32_t pa_stream_get_index(const pa_stream *s)
+{
+    return 1;
+}
+
+uint32_t pa_stream_get_device_index(const pa_stream *s)
+{
+    return 0;
+}
+
+const char *pa_stream_get_device_name(const pa_stream *s)
+{
+    return "stub";
+}
+
+const pa_sample_spec *pa_stream_get_sample_spec(pa_stream *s)
+{
+    return &s->ss;
+}
+
+pa_format_info *pa_stream_get_format_info(const pa_stream *s)
+{
+    return s->format;
+}
+
+/* Format info */
+
+pa_format_info *pa_format_info_new(void)
+{
+    struct stub_format *f = calloc(1, sizeof(*f));
+    f->info.encoding = PA_ENCODING_INVALID;
+    return &f->info;
+}
+
+void pa_format_info_free(pa_format_info *f)
+{
+    free(f);
+}
+
+pa_format_info *pa_format_info_from_sample_spec(const pa_sample_spec *ss, const pa_channel_map *map)
+{
+    pa_format_info *f = pa_format_info_new();
+    f->encoding = PA_ENCODING_PCM;
+    ((struct stub_format *)f)->ss = *ss;
+    return f;
+}
+
+int pa_format_info_is_pcm(const pa_format_info *f)
+{
+    return f->encoding == PA_ENCODING_PCM;
+}
+
+void pa_format_info_set_rate(pa_format_info *f, int rate)
+{
+    ((struct stub_format *)f)->ss.rate = rate;
+}
+
+void pa_format_info_set_channels(pa_format_info *f, int channels)
+{
+    ((struct stub_format *)f)->ss.channels = channels;
+}
+
+const char *pa_encoding_to_string(pa_encoding_t e)
+{
+    static const char *names[PA_ENCODING_MAX] = {
+        [PA_ENCODING_ANY] = "any", [PA_ENCODING_PCM] = "pcm",
+        [PA_ENCODING_AC3_IEC61937] = "ac3-iec61937", [PA_ENCODING_EAC3_IEC61937] = "eac3-iec61937",
+        [PA_ENCODING_MPEG_IEC61937] = "mpeg-iec61937", [PA_ENCODING_DTS_IEC61937] = "dts-iec61937",
+        [PA_ENCODING_MPEG2_AAC_IEC61937] = "mpeg2-aac-iec61937",
+    };
+    return e >= 0 && e < PA_ENCODING_MAX ? names[e] : NULL;
+}
+
+static void stream_fix_attr(pa_stream *s)
+{
+    pa_buffer_attr *a = &s->attr;
+    if (a->tlength == (uint32_t)-1)
+        a->tlength = pa_usec_to_bytes(2 * PA_USEC_PER_SEC, &s->ss);
+    if (a->minreq == (uint32_t)-1)
+        a->minreq = a->tlength / 4;
+    if (a->prebuf == (uint32_t)-1)
+        a->prebuf = a->tlength - a->minreq;
+    if (a->maxlength == (uint32_t)-1)
+        a->maxlength = 4 * 1024 * 1024;
+}
+
+int pa_stream_connect_playback(pa_stream *s, const char *dev, const pa_buffer_attr *attr, pa_stream_flags_t flags, const pa_cvolume *volume, pa_stream *sync_stream)
+{
+    s->attr = *attr;
+    stream_fix_attr(s);
+    s->corked = !!(flags & PA_STREAM_START_CORKED);
+    stream_set_state(s, PA_STREAM_CREATING);
+    stream_set_state(s, PA_STREAM_READY);
+    return 0;
+}
+
+int pa_stream_disconnect(pa_stream *s)
+{
+    if (s->state != PA_STREAM_READY)
+        return -PA_ERR_BADSTATE;
+    stream_drain_end(s, 0);
+    stream_set_state(s, PA_STREAM_TERMINATED);
+    return 0;
+}
+
+void pa_stream_set_state_callback(pa_stream *s, pa_stream_notify_cb_t cb, void *userdata)
+{
+    s->state_cb = cb;
+    s->state_userdata = userdata;
+}
+
+void pa_stream_set_write_callback(pa_stream *p, pa_stream_request_cb_t cb, void *userdata)
+{
+    p->write_cb = cb;
+    p->write_userdata = userdata;
+}
+
+void pa_stream_set_event_callback(pa_stream *p, pa_stream_event_cb_t cb, void *userdata)
+{
+}
+
+void pa_stream_set_moved_callback(pa_stream *p, pa_stream_notify_cb_t cb, void *userdata)
+{
+}
+
+void pa_stream_set_underflow_callback(pa_stream *p, pa_stream_notify_cb_t cb, void *userdata)
+{
+}
+
+void pa_stream_set_overflow_callback(pa_stream *p, pa_stream_notify_cb_t cb, void *userdata)
+{
+}
+
+void pa_stream_set_buffer_attr_callback(pa_stream *p, pa_stream_notify_cb_t cb, void *userdata)
+{
+}
+
+void pa_stream_set_latency_update_callback(pa_stream *p, pa_stream_notify_cb_t cb, void *userdata)
+{
+}
+
+int pa_stream_begin_write(pa_stream *p, void **data, size_t *nbytes)
+{
+    size_t frame = pa_frame_size(&p->ss);
+
+    if (*nbytes == (size_t)-1 || *nbytes > STUB_BLOCK_SIZE)
+        *nbytes = STUB_BLOCK_SIZE - STUB_BLOCK_SIZE % frame;
+    *data = p->wbuf;
+    return 0;
+}
+
+int pa_stream_write(pa_stream *p, const void *data, size_t nbytes, pa_free_cb_t free_cb, int64_t offset, pa_seek_mode_t seek)
+{
+    if (nbytes % pa_frame_size(&p->ss)) {
+        write_errors++;
+        return -PA_ERR_INVALID;
+    }
+    p->writes++;
+    p->bytes += nbytes;
+    if (free_cb && data != p->wbuf)
+        free_cb((void *)data);
+    return 0;
+}
+
+/* Requests only come from stub_stream_request(), nothing is ever left outstanding */
+size_t pa_stream_writable_size(const pa_stream *p)
+{
+    return 0;
+}
+
+const pa_buffer_attr *pa_stream_get_buffer_attr(pa_stream *s)
+{
+    return &s->attr;
+}
+
+int pa_stream_get_latency(pa_stream *s, pa_usec_t *r_usec, int *negative)
+{
+    return -PA_ERR_NODATA;
+}
+
+int pa_stream_get_time(pa_stream *s, pa_usec_t *r_usec)
+{
+    return -PA_ERR_NODATA;
+}
+
+static pa_operation *stream_op(pa_stream *s, pa_stream_success_cb_t cb, void *userdata)
+{
+    if (cb)
+        cb(s, 1, userdata);
+    return op_new();
+}
+
+/* Finishes the drain a corked stream held back, @done is 0 if the stream goes away first */
+static void stream_drain_end(pa_stream *s, int done)
+{
+    pa_operation *o = s->drain_op;
+
+    if (!o)
+        return;
+    s->drain_op = NULL;
+    if (o->state == PA_OPERATION_RUNNING) {
+        o->state = done ? PA_OPERATION_DONE : PA_OPERATION_CANCELLED;
+        if (done && s->drain_cb)
+            s->drain_cb(s, 1, s->drain_userdata);
+    }
+    pa_operation_unref(o);
+}
+
+pa_operation *pa_stream_cork(pa_stream *s, int b, pa_stream_success_cb_t cb, void *userdata)
+{
+    pa_operation *o;
+
+    s->corked = b;
+    o = stream_op(s, cb, userdata);
+    if (!b)
+        stream_drain_end(s, 1);
+    return o;
+}
+
+pa_operation *pa_stream_drain(pa_stream *s, pa_stream_success_cb_t cb, void *userdata)
+{
+    pa_operation *o;
+
+    if (!s->corked)
+        return stream_op(s, cb, userdata);
+
+    // Nothing plays out of a corked stream, the drain waits for the uncork
+    stream_drain_end(s, 0);
+    o = op_new();
+    o->state = PA_OPERATION_RUNNING;
+    o->refs++;
+    s->drain_op = o;
+    s->drain_cb = cb;
+    s->drain_userdata = userdata;
+    return o;
+}
+
+pa_operation *pa_stream_flush(pa_stream *s, pa_stream_success_cb_t cb, void *userdata)
+{
+    return stream_op(s, cb, userdata);
+}
+
+pa_operation *pa_stream_set_buffer_attr(pa_stream *s, const pa_buffer_attr *attr, pa_stream_success_cb_t cb, void *userdata)
+{
+    s->attr = *attr;
+    stream_fix_attr(s);
+    return stream_op(s, cb, userdata);
+}
+
+pa_operation *pa_stream_proplist_remove(pa_stream *s, const char *const keys[], pa_stream_success_cb_t cb, void *userdata)
+{
+    return stream_op(s, cb, userdata);
+}
+
+pa_operation *pa_stream_proplist_update(pa_stream *s, pa_update_mode_t mode, pa_proplist *p, pa_stream_success_cb_t cb, void *userdata)
+{
+    return stream_op(s, cb, userdata);
+}
+
+/* Benchmark hooks */
+
+pa_stream *stub_last_stream(void)
+{
+    return last_stream;
+}
+
+void stub_stream_request(pa_stream *s, size_t nbytes)
+{
+    pa_threaded_mainloop_lock(stub_ml);
+    if (s->write_cb)
+        s->write_cb(s, nbytes, s->write_userdata);
+    pa_threaded_mainloop_unlock(stub_ml);
+}
+
+uint64_t stub_stream_writes(pa_stream *s)
+{
+    return s->writes;
+}
+
+uint64_t stub_stream_bytes(pa_stream *s)
+{
+    return s->bytes;
+}
+
+int stub_stream_corked(pa_stream *s)
+{
+    return s->corked;
+}
+
+pa_stream *stub_stream_oldest(void)
+{
+    pa_stream *s = streams;
+
+    while (s && s->next)
+        s = s->next;
+    return s;
+}
+
+uint64_t stub_write_errors(void)
+{
+    return write_errors;
+}
+
+int stub_streams_playing(void)
+{
+    int n = 0;
+
+    pa_threaded_mainloop_lock(stub_ml);
+    for (pa_stream *s = streams; s; s = s->next) {
+        n += s->state == PA_STREAM_READY && !s->corked;
+    }
+    pa_threaded_mainloop_unlock(stub_ml);
+    return n;
+}
+
+void stub_timers_run(pa_usec_t usec)
+{
+    struct timeval due;
+    pa_time_event *e;
+
+    pa_timeval_add(pa_gettimeofday(&due), usec);
+    pa_threaded_mainloop_lock(stub_ml);
+    unsigned run = ++timers_run;
+    do {
+        // A callback can free any timer, start over after each one
+        for (e = timers; e; e = e->next) {
+            if (e->run != run && e->cb && timercmp(&e->tv, &due, <=))
+                break;
+        }
+        if (e) {
+            e->run = run;
+            e->cb(&stub_ml->api, e, &e->tv, e->userdata);
+        }
+    } while (e);
+    pa_threaded_mainloop_unlock(stub_ml);
+}
@@ -0,0 +1,44 @@
+/*
+    Stub libpulse for the PulseAudio output plugin benchmarks
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef STUB_PULSE_H
+#define STUB_PULSE_H
+
+#include <pulse/pulseaudio.h>
+#include <stdint.h>
+
+/* Largest chunk pa_stream_begin_write hands out, like a libpulse mempool slot */
+#define STUB_BLOCK_SIZE 65472
+
+/* Most recently created playback stream */
+pa_stream *stub_last_stream(void);
+
+/* Oldest stream still referenced, the plugin's main stream while fan-out streams are open */
+pa_stream *stub_stream_oldest(void);
+
+/* Calls the stream's write callback with the mainloop locked, as the mainloop thread would */
+void stub_stream_request(pa_stream *s, size_t nbytes);
+
+uint64_t stub_stream_writes(pa_stream *s);
+
+uint64_t stub_stream_bytes(pa_stream *s);
+
+/* Whether the stream was last corked or connected corked */
+int stub_stream_corked(pa_stream *s);
+
+/* Writes rejected with PA_ERR_INVALID for not being whole frames, across all streams */
+uint64_t stub_write_errors(void);
+
+/* Connected streams that are not corked, the plugin's main stream and its fan-out streams */
+int stub_streams_playing(void);
+
+/* Fires, with the mainloop locked, the timers due within @usec from now, each at most once */
+void stub_timers_run(pa_usec_t usec);
+
+#endif
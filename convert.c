@@ -0,0 +1,384 @@
+/*
+    Sample format conversion kernels for the PulseAudio output plugin
+    Copyright (C) 2015-2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    Every kernel produces exactly the output of its scalar reference:
+    scale, clip, then round to nearest even (lrintf in the default rounding
+    mode, cvtps2dq on x86, fcvtns on AArch64).
+
+    The SIMD kernels are compiled with per-function target attributes and
+    picked at runtime, so a binary built without -march still uses AVX2
+    where the CPU has it.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define CONVERT_NEON_BUILT
+#include <arm_neon.h>
+#endif
+
+#define S16_SCALE 32768.0f
+#define S16_MAX 32767.0f
+#define S24_SCALE 8388608.0f
+#define S24_MAX 8388607.0f
+
+static inline int32_t
+_convert_one(float v, float scale, float max)
+{
+    v *= scale;
+    if (v > max)
+        v = max;
+    else if (v < -scale)
+        v = -scale;
+    return (int32_t)lrintf(v);
+}
+
+static void
+convert_s16_scalar(void *dst, const float *src, size_t samples)
+{
+    int16_t *d = dst;
+    for (size_t i = 0; i < samples; i++)
+        d[i] = (int16_t)_convert_one(src[i], S16_SCALE, S16_MAX);
+}
+
+static void
+convert_s24_32_scalar(void *dst, const float *src, size_t samples)
+{
+    int32_t *d = dst;
+    for (size_t i = 0; i < samples; i++)
+        d[i] = _convert_one(src[i], S24_SCALE, S24_MAX);
+}
+
+static void
+convert_s24_scalar(void *dst, const float *src, size_t samples)
+{
+    uint8_t *d = dst;
+    for (size_t i = 0; i < samples; i++, d += 3) {
+        uint32_t v = (uint32_t)_convert_one(src[i], S24_SCALE, S24_MAX);
+        d[0] = v;
+        d[1] = v >> 8;
+        d[2] = v >> 16;
+    }
+}
+
+/* Writes the low three bytes of each of @n values */
+static inline void
+_pack24(uint8_t *d, const int32_t *v, size_t n)
+{
+    for (size_t i = 0; i < n; i++, d += 3) {
+        d[0] = v[i];
+        d[1] = v[i] >> 8;
+        d[2] = v[i] >> 16;
+    }
+}
+
+#ifdef CONVERT_X86
+
+__attribute__((target("sse2"))) static inline __m128i
+_sse2_convert(const float *src, __m128 scale, __m128 max)
+{
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(src), scale);
+    v = _mm_max_ps(_mm_min_ps(v, max), _mm_sub_ps(_mm_setzero_ps(), scale));
+    return _mm_cvtps_epi32(v);
+}
+
+__attribute__((target("sse2"))) static void
+convert_s16_sse2(void *dst, const float *src, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(S16_SCALE), max = _mm_set1_ps(S16_MAX);
+    int16_t *d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i lo = _sse2_convert(src + i, scale, max);
+        __m128i hi = _sse2_convert(src + i + 4, scale, max);
+        _mm_storeu_si128((__m128i *)(d + i), _mm_packs_epi32(lo, hi));
+    }
+    convert_s16_scalar(d + i, src + i, samples - i);
+}
+
+__attribute__((target("sse2"))) static void
+convert_s24_32_sse2(void *dst, const float *src, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(S24_SCALE), max = _mm_set1_ps(S24_MAX);
+    int32_t *d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4)
+        _mm_storeu_si128((__m128i *)(d + i), _sse2_convert(src + i, scale, max));
+    convert_s24_32_scalar(d + i, src + i, samples - i);
+}
+
+/* SSE2 has no byte shuffle, so only the arithmetic is vectorized here */
+__attribute__((target("sse2"))) static void
+convert_s24_sse2(void *dst, const float *src, size_t samples)
+{
+    const __m128 scale = _mm_set1_ps(S24_SCALE), max = _mm_set1_ps(S24_MAX);
+    uint8_t *d = dst;
+    int32_t tmp[4];
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4, d += 12) {
+        _mm_storeu_si128((__m128i *)tmp, _sse2_convert(src + i, scale, max));
+        _pack24(d, tmp, 4);
+    }
+    convert_s24_scalar(d, src + i, samples - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+_avx2_convert(const float *src, __m256 scale, __m256 max)
+{
+    __m256 v = _mm256_mul_ps(_mm256_loadu_ps(src), scale);
+    v = _mm256_max_ps(_mm256_min_ps(v, max), _mm256_sub_ps(_mm256_setzero_ps(), scale));
+    return _mm256_cvtps_epi32(v);
+}
+
+__attribute__((target("avx2"))) static void
+convert_s16_avx2(void *dst, const float *src, size_t samples)
+{
+    const __m256 scale = _mm256_set1_ps(S16_SCALE), max = _mm256_set1_ps(S16_MAX);
+    int16_t *d = dst;
+    size_t i = 0;
+
+    for (; i + 16 <= samples; i += 16) {
+        __m256i lo = _avx2_convert(src + i, scale, max);
+        __m256i hi = _avx2_convert(src + i + 8, scale, max);
+        /* packs works per 128 bit lane, put the quadwords back in order */
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(d + i), v);
+    }
+    convert_s16_sse2(d + i, src + i, samples - i);
+}
+
+__attribute__((target("avx2"))) static void
+convert_s24_32_avx2(void *dst, const float *src, size_t samples)
+{
+    const __m256 scale = _mm256_set1_ps(S24_SCALE), max = _mm256_set1_ps(S24_MAX);
+    int32_t *d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+        _mm256_storeu_si256((__m256i *)(d + i), _avx2_convert(src + i, scale, max));
+    convert_s24_32_sse2(d + i, src + i, samples - i);
+}
+
+__attribute__((target("avx2"))) static void
+convert_s24_avx2(void *dst, const float *src, size_t samples)
+{
+    const __m256 scale = _mm256_set1_ps(S24_SCALE), max = _mm256_set1_ps(S24_MAX);
+    /* Drop the top byte of each sample, 12 packed bytes per lane */
+    const __m256i pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint8_t *d = dst;
+    size_t i = 0;
+
+    /* Each 16 byte store spills 4 bytes past its 12, which the next store
+       overwrites; keep two samples (6 bytes) in reserve for the last one */
+    for (; i + 10 <= samples; i += 8, d += 24) {
+        __m256i v = _mm256_shuffle_epi8(_avx2_convert(src + i, scale, max), pack);
+        _mm_storeu_si128((__m128i *)d, _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)(d + 12), _mm256_extracti128_si256(v, 1));
+    }
+    convert_s24_sse2(d, src + i, samples - i);
+}
+
+#endif /* CONVERT_X86 */
+
+#ifdef CONVERT_NEON_BUILT
+
+static inline int32x4_t
+_neon_convert(const float *src, float32x4_t scale, float32x4_t max)
+{
+    float32x4_t v = vmulq_f32(vld1q_f32(src), scale);
+    v = vmaxq_f32(vminq_f32(v, max), vnegq_f32(scale));
+    return vcvtnq_s32_f32(v);
+}
+
+static void
+convert_s16_neon(void *dst, const float *src, size_t samples)
+{
+    const float32x4_t scale = vdupq_n_f32(S16_SCALE), max = vdupq_n_f32(S16_MAX);
+    int16_t *d = dst;
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8) {
+        int16x4_t lo = vqmovn_s32(_neon_convert(src + i, scale, max));
+        int16x4_t hi = vqmovn_s32(_neon_convert(src + i + 4, scale, max));
+        vst1q_s16(d + i, vcombine_s16(lo, hi));
+    }
+    convert_s16_scalar(d + i, src + i, samples - i);
+}
+
+static void
+convert_s24_32_neon(void *dst, const float *src, size_t samples)
+{
+    const float32x4_t scale = vdupq_n_f32(S24_SCALE), max = vdupq_n_f32(S24_MAX);
+    int32_t *d = dst;
+    size_t i = 0;
+
+    for (; i + 4 <= samples; i += 4)
+        vst1q_s32(d + i, _neon_convert(src + i, scale, max));
+    convert_s24_32_scalar(d + i, src + i, samples - i);
+}
+
+static void
+convert_s24_neon(void *dst, const float *src, size_t samples)
+{
+    const float32x4_t scale = vdupq_n_f32(S24_SCALE), max = vdupq_n_f32(S24_MAX);
+    uint8_t *d = dst;
+    size_t i = 0;
+
+    /* Interleaved store of the three low byte planes of 16 samples */
+    for (; i + 16 <= samples; i += 16, d += 48) {
+        uint8x16x4_t b;
+        for (int j = 0; j < 4; j++)
+            b.val[j] = vreinterpretq_u8_s32(_neon_convert(src + i + j * 4, scale, max));
+        /* uzp twice puts byte k of every sample in plane k */
+        uint8x16x2_t p02 = vuzpq_u8(vuzpq_u8(b.val[0], b.val[1]).val[0],
+                                    vuzpq_u8(b.val[2], b.val[3]).val[0]);
+        uint8x16x2_t p13 = vuzpq_u8(vuzpq_u8(b.val[0], b.val[1]).val[1],
+                                    vuzpq_u8(b.val[2], b.val[3]).val[1]);
+        uint8x16x3_t out = {{ p02.val[0], p13.val[0], p02.val[1] }};
+        vst3q_u8(d, out);
+    }
+    convert_s24_scalar(d, src + i, samples - i);
+}
+
+#endif /* CONVERT_NEON_BUILT */
+
+static const convert_fn kernels[CONVERT_FORMATS][CONVERT_ISAS] = {
+    [CONVERT_S16] = {
+        [CONVERT_SCALAR] = convert_s16_scalar,
+#ifdef CONVERT_X86
+        [CONVERT_SSE2] = convert_s16_sse2,
+        [CONVERT_AVX2] = convert_s16_avx2,
+#endif
+#ifdef CONVERT_NEON_BUILT
+        [CONVERT_NEON] = convert_s16_neon,
+#endif
+    },
+    [CONVERT_S24_32] = {
+        [CONVERT_SCALAR] = convert_s24_32_scalar,
+#ifdef CONVERT_X86
+        [CONVERT_SSE2] = convert_s24_32_sse2,
+        [CONVERT_AVX2] = convert_s24_32_avx2,
+#endif
+#ifdef CONVERT_NEON_BUILT
+        [CONVERT_NEON] = convert_s24_32_neon,
+#endif
+    },
+    [CONVERT_S24] = {
+        [CONVERT_SCALAR] = convert_s24_scalar,
+#ifdef CONVERT_X86
+        [CONVERT_SSE2] = convert_s24_sse2,
+        [CONVERT_AVX2] = convert_s24_avx2,
+#endif
+#ifdef CONVERT_NEON_BUILT
+        [CONVERT_NEON] = convert_s24_neon,
+#endif
+    },
+};
+
+static int
+_isa_supported(enum convert_isa isa)
+{
+    switch (isa) {
+    case CONVERT_SCALAR:
+        return 1;
+#ifdef CONVERT_X86
+    case CONVERT_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case CONVERT_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CONVERT_NEON_BUILT
+    case CONVERT_NEON:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t
+convert_sample_size(enum convert_format fmt)
+{
+    switch (fmt) {
+    case CONVERT_S16:
+        return 2;
+    case CONVERT_S24:
+        return 3;
+    case CONVERT_S24_32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+convert_fn
+convert_get(enum convert_format fmt, enum convert_isa isa)
+{
+    if (fmt <= CONVERT_NONE || fmt >= CONVERT_FORMATS || isa >= CONVERT_ISAS)
+        return NULL;
+    if (!kernels[fmt][isa] || !_isa_supported(isa))
+        return NULL;
+    return kernels[fmt][isa];
+}
+
+convert_fn
+convert_select(enum convert_format fmt, enum convert_isa *isa)
+{
+    static const enum convert_isa order[] = {
+        CONVERT_AVX2, CONVERT_NEON, CONVERT_SSE2, CONVERT_SCALAR
+    };
+
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        convert_fn fn = convert_get(fmt, order[i]);
+        if (fn) {
+            if (isa)
+                *isa = order[i];
+            return fn;
+        }
+    }
+    return NULL;
+}
+
+const char *
+convert_isa_name(enum convert_isa isa)
+{
+    static const char *names[CONVERT_ISAS] = {
+        [CONVERT_SCALAR] = "scalar",
+        [CONVERT_SSE2] = "SSE2",
+        [CONVERT_AVX2] = "AVX2",
+        [CONVERT_NEON] = "NEON",
+    };
+    return isa < CONVERT_ISAS ? names[isa] : "unknown";
+}
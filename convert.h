@@ -0,0 +1,54 @@
+/*
+    Sample format conversion kernels for the PulseAudio output plugin
+    Copyright (C) 2015-2020 Nicolai Syvertsen <saivert@saivert.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+
+/* Float input is clipped to [-1, 1) and rounded to nearest, all outputs little endian */
+enum convert_format {
+    CONVERT_NONE,
+    CONVERT_S16,        /* S16LE */
+    CONVERT_S24_32,     /* S24_32LE, 24 bit in the low bits of 32 */
+    CONVERT_S24,        /* packed S24LE, 3 bytes per sample */
+    CONVERT_FORMATS
+};
+
+enum convert_isa {
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_AVX2,
+    CONVERT_NEON,
+    CONVERT_ISAS
+};
+
+typedef void (*convert_fn)(void *dst, const float *src, size_t samples);
+
+/* Bytes per output sample */
+size_t convert_sample_size(enum convert_format fmt);
+
+/* Kernel for @isa, NULL if it is not built in or this CPU lacks it */
+convert_fn convert_get(enum convert_format fmt, enum convert_isa isa);
+
+/* Fastest kernel this CPU runs, its instruction set is stored in @isa if not NULL */
+convert_fn convert_select(enum convert_format fmt, enum convert_isa *isa);
+
+const char *convert_isa_name(enum convert_isa isa);
+
+#endif
@@ -17,15 +17,25 @@
 */
 
 
+#define _GNU_SOURCE
 
 #include <pulse/pulseaudio.h>
 
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #define DDB_API_LEVEL 10
 #include <deadbeef/deadbeef.h>
 
+#include "convert.h"
+
 #ifdef DBPULSE_DEBUG
 #define trace(...) { fprintf(stdout, __VA_ARGS__); }
 #else
@@ -33,6 +43,7 @@
 #endif
 
 #define log_err(...) { deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_DEFAULT, __VA_ARGS__); }
+#define log_info(...) { deadbeef->log_detailed (&plugin.plugin, DDB_LOG_LAYER_INFO, __VA_ARGS__); }
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
@@ -59,20 +70,114 @@ static DB_output_t plugin;
 #define CONFSTR_PULSE_BUFFERSIZE "pulse2.buffersize"
 #define CONFSTR_PULSE_VOLUMECONTROL "pulse2.volumecontrol"
 #define CONFSTR_PULSE_PAUSEONCORK "pulse2.pauseoncork"
+#define CONFSTR_PULSE_PERSISTENT "pulse2.persistent"
+#define CONFSTR_PULSE_IDLETIMEOUT "pulse2.idletimeout"
+#define CONFSTR_PULSE_PREFETCH "pulse2.prefetch"
+#define CONFSTR_PULSE_AUTOCORK "pulse2.autocork"
+#define CONFSTR_PULSE_ADAPTIVE "pulse2.adaptive"
+#define CONFSTR_PULSE_ADAPTIVE_MIN "pulse2.adaptive_min"
+#define CONFSTR_PULSE_ADAPTIVE_MAX "pulse2.adaptive_max"
+#define CONFSTR_PULSE_LOWLATENCY "pulse2.lowlatency"
+#define CONFSTR_PULSE_MINREQ "pulse2.minreq"
+#define CONFSTR_PULSE_PREBUF "pulse2.prebuf"
+#define CONFSTR_PULSE_STATSINTERVAL "pulse2.statsinterval"
+#define CONFSTR_PULSE_RECONNECT "pulse2.reconnect"
+#define CONFSTR_PULSE_SEEKFLUSH "pulse2.seekflush"
+#define CONFSTR_PULSE_TIMING "pulse2.timing"
+#define CONFSTR_PULSE_NATIVEFORMAT "pulse2.nativeformat"
+#define CONFSTR_PULSE_CONVERT "pulse2.convert"
+#define CONFSTR_PULSE_PASSTHROUGH "pulse2.passthrough"
+#define CONFSTR_PULSE_FANOUT "pulse2.fanout"
+#define CONFSTR_PULSE_REALTIME "pulse2.realtime"
+#define CONFSTR_PULSE_RTPRIO "pulse2.rtprio"
+#define CONFSTR_PULSE_RTPOLICY "pulse2.rtpolicy"
+#define CONFSTR_PULSE_NICE "pulse2.nice"
+#define CONFSTR_PULSE_CPUS "pulse2.cpus"
 #define PULSE_DEFAULT_VOLUMECONTROL 0
 #define PULSE_DEFAULT_BUFFERSIZE 100
 #define PULSE_DEFAULT_PAUSEONCORK 0
+#define PULSE_DEFAULT_PERSISTENT 0
+#define PULSE_DEFAULT_IDLETIMEOUT 30
+#define PULSE_DEFAULT_PREFETCH 0
+#define PULSE_DEFAULT_AUTOCORK 0
+#define PULSE_DEFAULT_ADAPTIVE 0
+#define PULSE_DEFAULT_ADAPTIVE_MIN 20
+#define PULSE_DEFAULT_ADAPTIVE_MAX 1000
+#define PULSE_ADAPTIVE_HOLDOFF_MS 1000
+#define PULSE_ADAPTIVE_STABLE_MS 30000
+#define PULSE_DEFAULT_LOWLATENCY 0
+#define PULSE_DEFAULT_MINREQ 0
+#define PULSE_DEFAULT_PREBUF -1
+#define PULSE_DEFAULT_STATSINTERVAL 0
+#define PULSE_DEFAULT_RECONNECT 1
+#define PULSE_RECONNECT_MIN_MS 100
+#define PULSE_RECONNECT_MAX_MS 5000
+#define PULSE_VOLUME_ECHO_MS 100
+#define PULSE_DEFAULT_SEEKFLUSH 1
+#define PULSE_DEFAULT_TIMING 0
+#define PULSE_DEFAULT_NATIVEFORMAT 0
+#define PULSE_DEFAULT_CONVERT 0
+#define PULSE_DEFAULT_PASSTHROUGH 0
+#define PULSE_IEC61937_PROBE_MS 1000
+#define PULSE_FANOUT_MAX 4
+#define PULSE_FANOUT_MIN_MS 1000
+#define PULSE_DEFAULT_REALTIME 0
+#define PULSE_DEFAULT_RTPRIO 5
+#define PULSE_DEFAULT_RTPOLICY 0
+#define PULSE_DEFAULT_NICE -11
 
 
 
+/*
+ * Guards requested_fmt and the stream spec, never held across a server
+ * round trip. requested_fmt and plugin.fmt are also shared with
+ * _switch_start() on the mainloop, under fmt_mutex. That one is taken
+ * last and never with the mainloop lock still to come, so pulse_setformat()
+ * does not wait for the mainloop: the streamer can call it from inside
+ * streamer_read() on the prefetch thread while the mainloop joins that.
+ */
 static ddb_waveformat_t requested_fmt;
-static int state=OUTPUT_STATE_STOPPED;
 static uintptr_t mutex;
+static uintptr_t fmt_mutex;
 static int buffer_size;
-static int cork_requested;
 static char *tfbytecode;
+
+/*
+ * Output state, only accessed through the _state_* helpers so the
+ * mainloop and prefetch threads can read it without a lock.
+ *   STOPPED -> PLAYING     pulse_set_spec
+ *   PLAYING <-> PAUSED     pulse_pause, pulse_unpause and server cork requests
+ *   any -> STOPPED         pulse_play, pulse_stop, pulse_free and failed stream creation
+ * Server cork requests move with a compare and swap so they cannot
+ * resurrect a stream that was stopped meanwhile, a format switch leaves
+ * the state alone.
+ */
+static int state=OUTPUT_STATE_STOPPED;
+static int cork_requested;
+
+/* Set by pulse_setformat, taken by _switch_start() on the mainloop */
 static int _setformat_requested;
-static intptr_t _setformat_tid;
+
+static inline int _state_get(void)
+{
+    return __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+}
+
+static inline void _state_set(int to)
+{
+    __atomic_store_n(&state, to, __ATOMIC_RELEASE);
+}
+
+/* Moves from @from to @to, returns 0 if the state was something else */
+static inline int _state_move(int from, int to)
+{
+    return __atomic_compare_exchange_n(&state, &from, to, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline int _setformat_pending(void)
+{
+    return __atomic_load_n(&_setformat_requested, __ATOMIC_ACQUIRE);
+}
 
 static int pulse_init();
 
@@ -90,6 +195,28 @@ static int pulse_unpause();
 
 static int pulse_set_spec(ddb_waveformat_t *fmt);
 
+static int _pa_stream_create(pa_proplist *pl);
+
+static void _pa_stream_detach(void);
+
+static void _switch_cancel(void);
+
+static void _switch_uncork_ready(void);
+
+static void _switch_uncorked(void);
+
+static void _fan_stop(void);
+
+static void _fan_cork(int pause_);
+
+static void _fan_volume(void);
+
+static void _fan_flush(void);
+
+static void _fan_drift_log(void);
+
+static void _autocork_resume(void);
+
 
 static pa_threaded_mainloop	*pa_ml;
 static pa_context		*pa_ctx;
@@ -97,6 +224,67 @@ static pa_stream		*pa_s;
 static pa_channel_map		 pa_cmap;
 static pa_cvolume		 pa_vol;
 static pa_sample_spec		 pa_ss;
+static pa_time_event		*idle_timer;
+static pa_time_event		*stats_timer;
+static pa_proplist		*pending_pl;
+static int			 stream_pending;
+static pa_usec_t		 play_start_usec;
+static pa_time_event		*autocork_timer;
+static pa_usec_t		 autocork_usec;
+static size_t			 silence_run;
+static int			 idle_corked;
+static pa_time_event		*adaptive_timer;
+static size_t			 adaptive_min_bytes;
+static size_t			 adaptive_max_bytes;
+static pa_usec_t		 adaptive_last_usec;
+static pa_buffer_attr		 pa_attr;
+static pa_usec_t		 latency_min;
+static pa_usec_t		 latency_max;
+static pa_usec_t		 latency_sum;
+static uint64_t			 latency_samples;
+static int			 latency_logged;
+static pa_proplist		*stream_pl;
+static char			 preferred_sink[256];
+static int			 stream_dev_named;
+static int			 sink_fallback;
+static pa_time_event		*reconnect_timer;
+static int			 reconnecting;
+static int			 reconnect_attempt;
+static pa_usec_t		 reconnect_start_usec;
+static pa_cvolume		 volume_sent;
+static pa_operation		*volume_op;
+static int			 volume_dirty;
+static pa_usec_t		 volume_acked_usec;
+static pa_operation		*info_op;
+static int			 info_dirty;
+static pa_time_event		*info_timer;
+static pa_operation		*cork_op;
+static int			 cork_op_value;
+static int			 cork_want;
+static pa_usec_t		 cork_start_usec;
+static pa_usec_t		 seek_start_usec;
+static pa_usec_t		 seek_flushed_usec;
+static convert_fn		 convert_kernel;
+static size_t			 convert_size;
+static float			*convert_buf;
+static size_t			 convert_buf_samples;
+static size_t			 convert_carry;
+static pa_encoding_t		 iec_encoding = PA_ENCODING_INVALID;
+static int			 iec_active;
+static int			 iec_scan;
+static size_t			 iec_probe_bytes;
+static size_t			 iec_since;
+static pa_time_event		*iec_timer;
+static char			 carry[PA_CHANNELS_MAX * 4];
+static size_t			 carry_len;
+static pa_time_event		*rt_timer;
+static pa_stream		*switch_old;
+static pa_operation		*switch_drain_op;
+static int			 switch_uncork;
+static pa_usec_t		 switch_start_usec;
+static pa_usec_t		 switch_drained_usec;
+static int			 switch_filling;
+static pa_time_event		*switch_fill_timer;
 
 
 #define ret_pa_error(err)						\
@@ -107,7 +295,186 @@ static pa_sample_spec		 pa_ss;
 
 #define ret_pa_last_error() ret_pa_error(pa_context_errno(pa_ctx))
 
-static int _pa_nowait_unlock(pa_operation *o);
+/*
+ * Always-on counters for the output path. Updated with relaxed atomics so
+ * the producer thread, the mainloop thread and a stats dump from the GUI
+ * never need a lock. Histograms have power of two microsecond buckets.
+ */
+#define STATS_HIST_BUCKETS 16
+
+struct output_stats {
+    uint64_t underruns;
+    uint64_t overruns;
+    uint64_t bytes_written;
+    uint64_t silence_bytes;
+    uint64_t callbacks;
+    uint64_t writes;
+    uint64_t writes_max;
+    uint64_t callback_hist[STATS_HIST_BUCKETS];
+    uint64_t read_hist[STATS_HIST_BUCKETS];
+    uint64_t setformat_count;
+    uint64_t setformat_usec;
+    uint64_t setformat_usec_max;
+    uint64_t reconnects;
+    uint64_t reconnect_attempts;
+    uint64_t reconnect_usec;
+    uint64_t reconnect_usec_max;
+    uint64_t meta_events;
+    uint64_t meta_coalesced;
+    uint64_t meta_unchanged;
+    uint64_t meta_updates;
+    uint64_t meta_keys_sent;
+    uint64_t meta_handler_usec_max;
+    uint64_t meta_pl_lock_usec_max;
+    uint64_t meta_ml_lock_usec_max;
+    uint64_t volume_requests;
+    uint64_t volume_ops;
+    uint64_t volume_coalesced;
+    uint64_t volume_unchanged;
+    uint64_t volume_echoes;
+    uint64_t info_queries;
+    uint64_t info_suppressed;
+    uint64_t cork_ops;
+    uint64_t cork_merged;
+    uint64_t cork_usec_max;
+    uint64_t seeks;
+    uint64_t seek_usec;
+    uint64_t seek_usec_max;
+    uint64_t seek_dropped_bytes;
+    uint64_t fanout_skip_bytes;
+};
+
+static struct output_stats stats;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+static void _stats_max(uint64_t *field, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(field, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(field, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void _stats_hist_add(uint64_t *hist, pa_usec_t usec)
+{
+    int bucket = usec < 2 ? 0 : 63 - __builtin_clzll(usec);
+    if (bucket >= STATS_HIST_BUCKETS) {
+        bucket = STATS_HIST_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static void _stats_hist_format(char *buf, size_t size, const uint64_t *hist)
+{
+    size_t len = 0;
+
+    buf[0] = 0;
+    for (int i = 0; i < STATS_HIST_BUCKETS && len < size; i++) {
+        uint64_t n = __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+        if (!n) {
+            continue;
+        }
+        len += snprintf(buf + len, size - len, " %s%lluus:%llu", i == STATS_HIST_BUCKETS - 1 ? ">=" : "<",
+                1ULL << (i + 1 == STATS_HIST_BUCKETS ? i : i + 1), (unsigned long long)n);
+    }
+}
+
+#define STAT(field) ((unsigned long long)__atomic_load_n(&stats.field, __ATOMIC_RELAXED))
+
+/*
+ * Playback clock from the stream timing info. With PA_STREAM_INTERPOLATE_TIMING
+ * both values are interpolated locally between the automatic timing updates,
+ * so reading them costs no round trip. DB_output_t has no way to hand the
+ * output latency to the player, so the clock is reported in the log.
+ */
+static int _pa_clock_read(pa_usec_t *played, pa_usec_t *latency)
+{
+    int negative = 0;
+
+    if (!pa_s || pa_stream_get_time(pa_s, played) < 0
+        || pa_stream_get_latency(pa_s, latency, &negative) < 0) {
+        return -1;
+    }
+    if (negative) {
+        *latency = 0;
+    }
+    return 0;
+}
+
+/* Only the stats log and the fan-out drift check read the clock, skip the timing updates otherwise */
+static int _timing_wanted(void)
+{
+    char fanout[2];
+
+    if (deadbeef->conf_get_int(CONFSTR_PULSE_TIMING, PULSE_DEFAULT_TIMING)
+        || deadbeef->conf_get_int(CONFSTR_PULSE_STATSINTERVAL, PULSE_DEFAULT_STATSINTERVAL) > 0) {
+        return 1;
+    }
+    deadbeef->conf_get_str(CONFSTR_PULSE_FANOUT, "", fanout, sizeof(fanout));
+    return fanout[0] != 0;
+}
+
+/* Call with the mainloop locked */
+static void _pa_clock_log(void)
+{
+    pa_usec_t played, latency;
+
+    if (_pa_clock_read(&played, &latency) == 0) {
+        log_info("Pulseaudio: playback clock at %.3f s, audible output %.1f ms behind the decoder",
+                played / (double)PA_USEC_PER_SEC, latency / 1000.0);
+    }
+    _fan_drift_log();
+}
+
+/* Call with the mainloop locked if there is one */
+static void _stats_dump(void)
+{
+    char buf[512];
+    unsigned long long callbacks = STAT(callbacks);
+    unsigned long long setformats = STAT(setformat_count);
+    unsigned long long reconnects = STAT(reconnects);
+
+    log_info("Pulseaudio stats: underruns %llu, overruns %llu, written %llu bytes of which %llu silence",
+            STAT(underruns), STAT(overruns), STAT(bytes_written), STAT(silence_bytes));
+    log_info("Pulseaudio stats: %llu write callbacks, %.2f writes per callback, max %llu",
+            callbacks, callbacks ? (double)STAT(writes) / callbacks : 0.0, STAT(writes_max));
+    _stats_hist_format(buf, sizeof(buf), stats.callback_hist);
+    log_info("Pulseaudio stats: write callback time%s", buf);
+    _stats_hist_format(buf, sizeof(buf), stats.read_hist);
+    log_info("Pulseaudio stats: streamer_read time%s", buf);
+    log_info("Pulseaudio stats: %llu format changes, gap avg %.1f ms, max %.1f ms",
+            setformats, setformats ? STAT(setformat_usec) / 1000.0 / setformats : 0.0,
+            STAT(setformat_usec_max) / 1000.0);
+    log_info("Pulseaudio stats: %llu reconnects in %llu attempts, avg %.1f ms, max %.1f ms",
+            reconnects, STAT(reconnect_attempts), reconnects ? STAT(reconnect_usec) / 1000.0 / reconnects : 0.0,
+            STAT(reconnect_usec_max) / 1000.0);
+    log_info("Pulseaudio stats: %llu track changes, %llu coalesced, %llu unchanged, %llu updates with %llu keys",
+            STAT(meta_events), STAT(meta_coalesced), STAT(meta_unchanged), STAT(meta_updates), STAT(meta_keys_sent));
+    log_info("Pulseaudio stats: track change handler max %llu us, playlist lock max %llu us, mainloop lock max %llu us",
+            STAT(meta_handler_usec_max), STAT(meta_pl_lock_usec_max), STAT(meta_ml_lock_usec_max));
+    log_info("Pulseaudio stats: %llu volume changes, %llu sent, %llu coalesced, %llu unchanged, %llu echoes",
+            STAT(volume_requests), STAT(volume_ops), STAT(volume_coalesced), STAT(volume_unchanged), STAT(volume_echoes));
+    log_info("Pulseaudio stats: %llu sink input info queries, %llu suppressed",
+            STAT(info_queries), STAT(info_suppressed));
+    log_info("Pulseaudio stats: %llu pause/unpause operations, %llu merged, max %.1f ms to acknowledge",
+            STAT(cork_ops), STAT(cork_merged), STAT(cork_usec_max) / 1000.0);
+    log_info("Pulseaudio stats: %llu seeks, avg %.1f ms, max %.1f ms to first new audio, %llu prefetched bytes dropped",
+            STAT(seeks), STAT(seeks) ? STAT(seek_usec) / 1000.0 / STAT(seeks) : 0.0,
+            STAT(seek_usec_max) / 1000.0, STAT(seek_dropped_bytes));
+    log_info("Pulseaudio stats: fan-out skipped %llu bytes for lagging sinks", STAT(fanout_skip_bytes));
+    if (pa_ml) {
+        _pa_clock_log();
+    }
+}
+
+/* Timed streamer_read for both the write callback and the prefetch thread */
+static int _streamer_read(char *bytes, int size)
+{
+    pa_usec_t start = pa_rtclock_now();
+    int bytesread = deadbeef->streamer_read(bytes, size);
+    _stats_hist_add(stats.read_hist, pa_rtclock_now() - start);
+    return bytesread;
+}
 
 static pa_proplist *_create_app_proplist(void)
 {
@@ -127,58 +494,281 @@ static pa_proplist *_create_app_proplist(void)
     return pl;
 }
 
-static pa_proplist* get_stream_prop_song(DB_playItem_t *track)
+/*
+ * Track metadata for the stream proplist. DB_EV_SONGSTARTED only hands the
+ * track to a worker thread, which waits PULSE_META_COALESCE_MS so rapid
+ * skips collapse into one update, then evaluates the title format outside
+ * the mainloop lock and sends only the keys that changed since the last
+ * update with PA_UPDATE_MERGE.
+ */
+#define PULSE_META_COALESCE_MS 50
+
+enum {
+    META_NAME,
+    META_ARTIST,
+    META_TITLE,
+    META_FILENAME,
+    META_KEYS
+};
+
+static const char *const meta_keys[META_KEYS] = {
+    PA_PROP_MEDIA_NAME,
+    PA_PROP_MEDIA_ARTIST,
+    PA_PROP_MEDIA_TITLE,
+    PA_PROP_MEDIA_FILENAME,
+};
+
+struct track_meta {
+    char *v[META_KEYS];
+};
+
+static uintptr_t meta_mutex;
+static uintptr_t meta_cond;
+static intptr_t meta_tid;
+static int meta_quit;
+static int meta_busy;
+static DB_playItem_t *meta_track;
+static struct track_meta meta_sent;
+
+static void _meta_free(struct track_meta *m)
 {
-    pa_proplist	*pl;
-    int rc, notrackgiven=0;
+    for (int k = 0; k < META_KEYS; k++) {
+        free(m->v[k]);
+        m->v[k] = NULL;
+    }
+}
+
+/* Reads the metadata of @track, or of the playing track if NULL */
+static void _meta_read(DB_playItem_t *track, struct track_meta *m)
+{
+    int notrackgiven = 0;
     ddb_tf_context_t ctx = {
         ._size = sizeof(ddb_tf_context_t),
         .flags = DDB_TF_CONTEXT_NO_DYNAMIC,
         .plt = NULL,
         .iter = PL_MAIN};
 
-    pl = pa_proplist_new();
-    BUG_ON(!pl);
+    memset(m, 0, sizeof(*m));
 
     if (!track) {
         track = deadbeef->streamer_get_playing_track();
         notrackgiven = 1;
     }
     if (track) {
-
         char buf[1000];
-        const char *artist, *title;
+        const char *v;
 
         ctx.it = track;
         if (deadbeef->tf_eval(&ctx, tfbytecode, buf, sizeof(buf)) > 0) {
-            rc = pa_proplist_sets(pl, PA_PROP_MEDIA_NAME, buf);
-            BUG_ON(rc);
+            m->v[META_NAME] = strdup(buf);
         }
 
+        pa_usec_t start = pa_rtclock_now();
         deadbeef->pl_lock();
-        artist = deadbeef->pl_find_meta(track, "artist");
-        title = deadbeef->pl_find_meta(track, "title");
+        if ((v = deadbeef->pl_find_meta(track, "artist")))
+            m->v[META_ARTIST] = strdup(v);
+        if ((v = deadbeef->pl_find_meta(track, "title")))
+            m->v[META_TITLE] = strdup(v);
+        if ((v = deadbeef->pl_find_meta(track, ":URI")))
+            m->v[META_FILENAME] = strdup(v);
+        deadbeef->pl_unlock();
+        _stats_max(&stats.meta_pl_lock_usec_max, pa_rtclock_now() - start);
 
-        if (artist) {
-            rc = pa_proplist_sets(pl, PA_PROP_MEDIA_ARTIST, artist);
+        if (notrackgiven) deadbeef->pl_item_unref(track);
+    }
+    if (!m->v[META_NAME]) {
+        // pa_stream_new_with_proplist() fails without a media name, never drop it
+        m->v[META_NAME] = strdup("");
+    }
+}
+
+static pa_proplist* get_stream_prop_song(DB_playItem_t *track)
+{
+    struct track_meta m;
+    pa_proplist	*pl;
+    int rc;
+
+    pl = pa_proplist_new();
+    BUG_ON(!pl);
+
+    _meta_read(track, &m);
+    for (int k = 0; k < META_KEYS; k++) {
+        if (m.v[k]) {
+            rc = pa_proplist_sets(pl, meta_keys[k], m.v[k]);
             BUG_ON(rc);
         }
+    }
 
-        if (title) {
-            rc = pa_proplist_sets(pl, PA_PROP_MEDIA_TITLE, title);
-            BUG_ON(rc);
+    // A new stream starts out with these, updates are relative to them
+    deadbeef->mutex_lock(meta_mutex);
+    _meta_free(&meta_sent);
+    meta_sent = m;
+    deadbeef->mutex_unlock(meta_mutex);
+
+    return pl;
+}
+
+static void _meta_send(DB_playItem_t *track)
+{
+    struct track_meta m;
+    const char *removed[META_KEYS + 1];
+    int nchanged = 0, nremoved = 0;
+    pa_proplist *pl;
+    pa_operation *o;
+
+    _meta_read(track, &m);
+
+    pl = pa_proplist_new();
+    deadbeef->mutex_lock(meta_mutex);
+    for (int k = 0; k < META_KEYS; k++) {
+        const char *old = meta_sent.v[k];
+        if (m.v[k] && (!old || strcmp(old, m.v[k]))) {
+            pa_proplist_sets(pl, meta_keys[k], m.v[k]);
+            nchanged++;
+        } else if (!m.v[k] && old) {
+            removed[nremoved++] = meta_keys[k];
+        }
+    }
+    removed[nremoved] = NULL;
+    _meta_free(&meta_sent);
+    meta_sent = m;
+    deadbeef->mutex_unlock(meta_mutex);
+
+    if (!nchanged && !nremoved) {
+        STAT_ADD(meta_unchanged, 1);
+        pa_proplist_free(pl);
+        return;
+    }
+
+    // mutex keeps pulse_free() from tearing pa_ml down, a post can race its _meta_cancel()
+    deadbeef->mutex_lock(mutex);
+    if (!pa_ml) {
+        deadbeef->mutex_unlock(mutex);
+        pa_proplist_free(pl);
+        return;
+    }
+    pa_usec_t start = pa_rtclock_now();
+    pa_threaded_mainloop_lock(pa_ml);
+    if (pa_s) {
+        if (nchanged) {
+            o = pa_stream_proplist_update(pa_s, PA_UPDATE_MERGE, pl, NULL, NULL);
+            if (o)
+                pa_operation_unref(o);
         }
+        if (nremoved) {
+            o = pa_stream_proplist_remove(pa_s, removed, NULL, NULL);
+            if (o)
+                pa_operation_unref(o);
+        }
+    }
+    // Keep the proplists a stream gets recreated from current
+    pa_proplist *saved[] = {stream_pl, pending_pl};
+    for (int i = 0; i < 2; i++) {
+        if (!saved[i])
+            continue;
+        pa_proplist_update(saved[i], PA_UPDATE_MERGE, pl);
+        for (int k = 0; k < nremoved; k++)
+            pa_proplist_unset(saved[i], removed[k]);
+    }
+    pa_threaded_mainloop_unlock(pa_ml);
+    deadbeef->mutex_unlock(mutex);
+    _stats_max(&stats.meta_ml_lock_usec_max, pa_rtclock_now() - start);
+
+    STAT_ADD(meta_updates, 1);
+    STAT_ADD(meta_keys_sent, nchanged + nremoved);
+    pa_proplist_free(pl);
+}
 
-        rc = pa_proplist_sets(pl, PA_PROP_MEDIA_FILENAME, deadbeef->pl_find_meta(track, ":URI"));
-        BUG_ON(rc);
+static void _meta_worker(void *ctx)
+{
+    DB_playItem_t *track;
 
-        deadbeef->pl_unlock();
-        if (notrackgiven) deadbeef->pl_item_unref(track);
-    } else {
-        rc = pa_proplist_sets(pl, PA_PROP_MEDIA_NAME, "");
-        BUG_ON(rc);
+    deadbeef->mutex_lock(meta_mutex);
+    while (!meta_quit) {
+        if (!meta_track) {
+            deadbeef->cond_wait(meta_cond, meta_mutex);
+            continue;
+        }
+
+        // Let a burst of track changes settle, only the last one is sent
+        deadbeef->mutex_unlock(meta_mutex);
+        usleep(PULSE_META_COALESCE_MS * 1000);
+        deadbeef->mutex_lock(meta_mutex);
+
+        track = meta_track;
+        meta_track = NULL;
+        if (!track || meta_quit) {
+            if (track)
+                deadbeef->pl_item_unref(track);
+            continue;
+        }
+        meta_busy = 1;
+        deadbeef->mutex_unlock(meta_mutex);
+
+        _meta_send(track);
+        deadbeef->pl_item_unref(track);
+
+        deadbeef->mutex_lock(meta_mutex);
+        meta_busy = 0;
+        deadbeef->cond_broadcast(meta_cond);
     }
-    return pl;
+    deadbeef->mutex_unlock(meta_mutex);
+}
+
+/* Hands @track to the metadata worker, replacing one that was not sent yet */
+static void _meta_post(DB_playItem_t *track)
+{
+    deadbeef->pl_item_ref(track);
+    deadbeef->mutex_lock(meta_mutex);
+    if (meta_track) {
+        deadbeef->pl_item_unref(meta_track);
+        STAT_ADD(meta_coalesced, 1);
+    }
+    meta_track = track;
+    deadbeef->cond_broadcast(meta_cond);
+    deadbeef->mutex_unlock(meta_mutex);
+}
+
+/* Drops a queued update and waits for one in flight, so the mainloop can be freed */
+static void _meta_cancel(void)
+{
+    deadbeef->mutex_lock(meta_mutex);
+    if (meta_track) {
+        deadbeef->pl_item_unref(meta_track);
+        meta_track = NULL;
+    }
+    while (meta_busy) {
+        deadbeef->cond_wait(meta_cond, meta_mutex);
+    }
+    deadbeef->mutex_unlock(meta_mutex);
+}
+
+static void _meta_start(void)
+{
+    meta_mutex = deadbeef->mutex_create();
+    meta_cond = deadbeef->cond_create();
+    meta_quit = 0;
+    meta_tid = deadbeef->thread_start(_meta_worker, NULL);
+}
+
+static void _meta_stop(void)
+{
+    deadbeef->mutex_lock(meta_mutex);
+    meta_quit = 1;
+    deadbeef->cond_broadcast(meta_cond);
+    deadbeef->mutex_unlock(meta_mutex);
+    if (meta_tid) {
+        deadbeef->thread_join(meta_tid);
+        meta_tid = 0;
+    }
+
+    if (meta_track) {
+        deadbeef->pl_item_unref(meta_track);
+        meta_track = NULL;
+    }
+    _meta_free(&meta_sent);
+    deadbeef->cond_free(meta_cond);
+    deadbeef->mutex_free(meta_mutex);
 }
 
 static pa_proplist *_create_stream_proplist(void)
@@ -222,302 +812,2423 @@ static const char *_pa_context_state_str(pa_context_state_t s)
 }
 #endif
 
-static void _pa_context_running_cb(pa_context *c, void *data)
-{
-    const pa_context_state_t cs = pa_context_get_state(c);
+/*
+ * Sink list kept current over pa_ctx with a sink subscription, so
+ * enum_soundcards can answer from memory instead of connecting. Written on
+ * the mainloop thread, read from the GUI thread under sinks_mutex.
+ */
+struct sink_entry {
+    uint32_t index;
+    char *name;
+    char *desc;
+    pa_sample_spec ss;
+    struct sink_entry *next;
+};
 
-    trace("pulse: context state has changed to %s\n", _pa_context_state_str(cs));
+static struct sink_entry *sinks;
+static int sinks_valid;
+static char *default_sink;
+static uintptr_t sinks_mutex;
 
-    switch (cs) {
-    case PA_CONTEXT_READY:
-    case PA_CONTEXT_FAILED:
-    case PA_CONTEXT_TERMINATED:
-        pa_threaded_mainloop_signal(pa_ml, 0);
-    default:
-        return;
+// Avoid crazy long descriptions, they grow the GTK dropdown box in deadbeef GUI
+// Truncate with a middle ellipsis so we catch output port names that are always at the end
+static void _sink_description(const char *desc, char *buf, size_t size)
+{
+    size_t len;
+
+    if (!desc) {
+        desc = "";
+    }
+    len = strlen(desc);
+    if (len > 80) {
+        snprintf(buf, size, "%.38s...%s", desc, desc + len - 38);
+    } else {
+        snprintf(buf, size, "%s", desc);
     }
 }
 
-#ifdef DBPULSE_DEBUG
-static const char *_pa_stream_state_str(pa_stream_state_t s)
+static void _sink_cache_clear(void)
 {
-    switch (s) {
-    case PA_STREAM_CREATING:
-        return "PA_STREAM_CREATING";
-    case PA_STREAM_FAILED:
-        return "PA_STREAM_FAILED";
-    case PA_STREAM_READY:
-        return "PA_STREAM_READY";
-    case PA_STREAM_TERMINATED:
-        return "PA_STREAM_TERMINATED";
-    case PA_STREAM_UNCONNECTED:
-        return "PA_STREAM_UNCONNECTED";
+    deadbeef->mutex_lock(sinks_mutex);
+    while (sinks) {
+        struct sink_entry *next = sinks->next;
+        free(sinks->name);
+        free(sinks->desc);
+        free(sinks);
+        sinks = next;
     }
-
-    return "unknown";
+    sinks_valid = 0;
+    free(default_sink);
+    default_sink = NULL;
+    deadbeef->mutex_unlock(sinks_mutex);
 }
-#endif
-
-static void _pa_stream_running_cb(pa_stream *s, void *data)
-{
-    const pa_stream_state_t ss = pa_stream_get_state(s);
 
-    trace("pulse: stream state has changed to %s\n", _pa_stream_state_str(ss));
+/* userdata of the sink info queries */
+#define SINK_INFO_UPDATE NULL
+#define SINK_INFO_LIST ((void *)1)
+#define SINK_INFO_NEW ((void *)2)
 
-    switch (ss) {
-    case PA_STREAM_FAILED:
-        log_err("Pulseaudio: Stopping playback. Reason: %s", pa_strerror(pa_context_errno(pa_ctx)));
-        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
-    case PA_STREAM_READY:
-    case PA_STREAM_TERMINATED:
-        pa_threaded_mainloop_signal(pa_ml, 0);
-    default:
-        return;
-    }
+static int _sink_is_default(const char *name)
+{
+    return !strcmp(name, "default");
 }
 
-static void _pa_sink_input_info_cb(pa_context *c,
-                   const pa_sink_input_info *i,
-                   int eol,
-                   void *data)
+/* True only when a complete sink list lacks @name, an incomplete cache never vetoes a device */
+static int _sink_cache_missing(const char *name)
 {
-    if (i && plugin.has_volume) {
-        if (pa_cvolume_equal(&pa_vol, &i->volume)) return;
-        memcpy(&pa_vol, &i->volume, sizeof(pa_vol));
-        pa_volume_t v = pa_cvolume_avg(&pa_vol);
-        if (v <= PA_VOLUME_NORM) {
-            deadbeef->volume_set_amp(pa_sw_volume_to_linear(v));
+    struct sink_entry *e;
+    int missing;
+
+    deadbeef->mutex_lock(sinks_mutex);
+    missing = sinks_valid;
+    for (e = sinks; e && missing; e = e->next) {
+        if (!strcmp(e->name, name)) {
+            missing = 0;
         }
     }
+    deadbeef->mutex_unlock(sinks_mutex);
+    return missing;
 }
 
-static void set_volume_value(void)
+static void _sink_move_cb(pa_context *c, int success, void *userdata)
 {
-    pa_cvolume_set(&pa_vol, pa_ss.channels, pa_sw_volume_from_linear(deadbeef->volume_get_amp()));
+    if (!success) {
+        log_err("Pulseaudio: Failed to move stream to %s. Reason: %s", (const char *)userdata, pa_strerror(pa_context_errno(c)));
+    }
+    free(userdata);
 }
 
-static int set_volume()
+/* Moves the live stream to another sink keeping pa_s and its buffered audio, call with the mainloop locked */
+static void _sink_move(const char *name)
 {
-    if (state == OUTPUT_STATE_STOPPED || !pa_s || !plugin.has_volume) {
-        return -OP_ERROR_INTERNAL;
-    }
-
-    set_volume_value();
+    pa_operation *o;
+    const char *cur;
+    char *n;
 
-    pa_threaded_mainloop_lock(pa_ml);
-    uint32_t idx = pa_stream_get_index(pa_s);
-    if (idx == PA_INVALID_INDEX) {
-        pa_threaded_mainloop_unlock(pa_ml);
-        return -OP_ERROR_INTERNAL;
+    if (!pa_s || pa_stream_get_state(pa_s) != PA_STREAM_READY) {
+        return;
+    }
+    cur = pa_stream_get_device_name(pa_s);
+    if (cur && !strcmp(cur, name)) {
+        return;
     }
-    return _pa_nowait_unlock(pa_context_set_sink_input_volume(pa_ctx,
-                            idx,
-                            &pa_vol,
-                            NULL,
-                            NULL));
 
+    log_info("Pulseaudio: Moving stream from %s to %s", cur ? cur : "unknown sink", name);
+    n = strdup(name);
+    o = pa_context_move_sink_input_by_name(pa_ctx, pa_stream_get_index(pa_s), name, _sink_move_cb, n);
+    if (o)
+        pa_operation_unref(o);
+    else
+        free(n);
 }
 
-static void _pa_stream_success_cb(pa_stream *s, int success, void *data)
+static void _sink_default_info_cb(pa_context *c, const pa_server_info *i, void *userdata)
 {
-    pa_threaded_mainloop_signal(pa_ml, 0);
+    if (i && i->default_sink_name) {
+        _sink_move(i->default_sink_name);
+    }
 }
 
-static int _pa_wait_unlock(pa_operation *o)
+/* Moves the live stream to the configured device, or to the default sink if that is missing */
+static void _sink_move_preferred(void)
 {
-    pa_operation_state_t state;
+    pa_operation *o;
 
-    if (!o) {
-        pa_threaded_mainloop_unlock(pa_ml);
-        ret_pa_last_error();
+    if (_sink_is_default(preferred_sink) || _sink_cache_missing(preferred_sink)) {
+        o = pa_context_get_server_info(pa_ctx, _sink_default_info_cb, NULL);
+        if (o)
+            pa_operation_unref(o);
+    } else {
+        _sink_move(preferred_sink);
     }
-
-    while ((state = pa_operation_get_state(o)) == PA_OPERATION_RUNNING)
-        pa_threaded_mainloop_wait(pa_ml);
-
-    pa_operation_unref(o);
-    pa_threaded_mainloop_unlock(pa_ml);
-
-    if (state == PA_OPERATION_DONE)
-        return OP_ERROR_SUCCESS;
-    else
-        ret_pa_last_error();
 }
 
-static int _pa_nowait_unlock(pa_operation *o)
+static void _sink_cache_info_cb(pa_context *c, const pa_sink_info *i, int eol, void *userdata)
 {
-    if (!o) {
-        pa_threaded_mainloop_unlock(pa_ml);
-        ret_pa_last_error();
-    }
-
-    pa_operation_unref(o);
-    pa_threaded_mainloop_unlock(pa_ml);
+    struct sink_entry *e, **tail;
+    char buf[256];
 
-    return OP_ERROR_SUCCESS;
+    if (eol) {
+        if (userdata == SINK_INFO_LIST) {
+            // End of the initial full listing
+            deadbeef->mutex_lock(sinks_mutex);
+            sinks_valid = 1;
+            deadbeef->mutex_unlock(sinks_mutex);
+        }
+        return;
+    }
+    if (!i) {
+        return;
+    }
+
+    _sink_description(i->description, buf, sizeof(buf));
+
+    deadbeef->mutex_lock(sinks_mutex);
+    for (tail = &sinks; *tail; tail = &(*tail)->next) {
+        if ((*tail)->index == i->index) {
+            break;
+        }
+    }
+    e = *tail;
+    if (!e) {
+        e = calloc(1, sizeof(*e));
+        e->index = i->index;
+        *tail = e;
+    }
+    free(e->name);
+    free(e->desc);
+    e->name = strdup(i->name ? i->name : "");
+    e->desc = strdup(buf);
+    e->ss = i->sample_spec;
+    deadbeef->mutex_unlock(sinks_mutex);
+
+    if (userdata == SINK_INFO_NEW && i->name && !_sink_is_default(preferred_sink)
+            && !strcmp(i->name, preferred_sink)) {
+        // The configured device is back, move the stream home
+        _sink_move(preferred_sink);
+    }
 }
 
-static int _pa_stream_flush(void)
+static void _sink_cache_remove(uint32_t index)
 {
-    pa_threaded_mainloop_lock(pa_ml);
-    return _pa_wait_unlock(pa_stream_flush(pa_s, _pa_stream_success_cb, NULL));
+    struct sink_entry **p;
+
+    deadbeef->mutex_lock(sinks_mutex);
+    for (p = &sinks; *p; p = &(*p)->next) {
+        if ((*p)->index == index) {
+            struct sink_entry *e = *p;
+            *p = e->next;
+            free(e->name);
+            free(e->desc);
+            free(e);
+            break;
+        }
+    }
+    deadbeef->mutex_unlock(sinks_mutex);
 }
 
-static int _pa_stream_cork(int pause_)
+static void _server_info_cb(pa_context *c, const pa_server_info *i, void *userdata)
 {
-    pa_threaded_mainloop_lock(pa_ml);
+    if (!i) {
+        return;
+    }
+    deadbeef->mutex_lock(sinks_mutex);
+    free(default_sink);
+    default_sink = i->default_sink_name ? strdup(i->default_sink_name) : NULL;
+    deadbeef->mutex_unlock(sinks_mutex);
+}
+
+/* Sample spec of the sink the stream is going to, from the cache */
+static int _sink_target_spec(pa_sample_spec *ss)
+{
+    char dev[sizeof(preferred_sink)];
+    const char *name;
+    int rc = -1;
+
+    deadbeef->conf_get_str(PULSE_PLUGIN_ID "_soundcard", "default", dev, sizeof(dev));
+
+    deadbeef->mutex_lock(sinks_mutex);
+    name = _sink_is_default(dev) ? default_sink : dev;
+    for (struct sink_entry *e = sinks; e && name; e = e->next) {
+        if (!strcmp(e->name, name)) {
+            *ss = e->ss;
+            rc = 0;
+            break;
+        }
+    }
+    if (rc && name != default_sink && default_sink) {
+        // Configured device missing, the stream falls back to the default sink
+        for (struct sink_entry *e = sinks; e; e = e->next) {
+            if (!strcmp(e->name, default_sink)) {
+                *ss = e->ss;
+                rc = 0;
+                break;
+            }
+        }
+    }
+    deadbeef->mutex_unlock(sinks_mutex);
+    return rc;
+}
+
+/*
+ * In-plugin conversion on top of native format mode: for an S16LE, S24LE
+ * or S24_32LE sink the streamer delivers float and stream_request_cb()
+ * converts it with the fastest kernel in convert.c straight into the
+ * write buffer. Sets @fmt to float and returns the conversion to use.
+ */
+static enum convert_format _convert_target(ddb_waveformat_t *fmt, pa_sample_format_t sink_format)
+{
+    enum convert_format conv;
+
+    if (!deadbeef->conf_get_int(CONFSTR_PULSE_CONVERT, PULSE_DEFAULT_CONVERT)) {
+        return CONVERT_NONE;
+    }
+    switch (sink_format) {
+    case PA_SAMPLE_S16LE:
+        conv = CONVERT_S16;
+        break;
+    case PA_SAMPLE_S24LE:
+        conv = CONVERT_S24;
+        break;
+    case PA_SAMPLE_S24_32LE:
+        conv = CONVERT_S24_32;
+        break;
+    default:
+        return CONVERT_NONE;
+    }
+    fmt->bps = 32;
+    fmt->is_float = 1;
+    return conv;
+}
+
+/*
+ * Native format mode: replace the sample format and rate of @fmt by the
+ * closest ones the target sink runs at, so the streamer does the only
+ * conversion and the server neither converts nor resamples. The channel
+ * layout stays with the track, remixing is not the server's only cost here.
+ * @conv is set to the in-plugin conversion, see _convert_target().
+ * Returns 1 if @fmt was changed.
+ */
+static int _native_format(ddb_waveformat_t *fmt, enum convert_format *conv)
+{
+    pa_sample_spec ss;
+
+    *conv = CONVERT_NONE;
+    if (!deadbeef->conf_get_int(CONFSTR_PULSE_NATIVEFORMAT, PULSE_DEFAULT_NATIVEFORMAT)
+        || _sink_target_spec(&ss) < 0) {
+        return 0;
+    }
+
+    switch (ss.format) {
+    case PA_SAMPLE_U8:
+        fmt->bps = 8;
+        fmt->is_float = 0;
+        break;
+    case PA_SAMPLE_S16LE:
+    case PA_SAMPLE_S16BE:
+        fmt->bps = 16;
+        fmt->is_float = 0;
+        break;
+    case PA_SAMPLE_S24LE:
+    case PA_SAMPLE_S24BE:
+        fmt->bps = 24;
+        fmt->is_float = 0;
+        break;
+    case PA_SAMPLE_S32LE:
+    case PA_SAMPLE_S32BE:
+    case PA_SAMPLE_S24_32LE:
+    case PA_SAMPLE_S24_32BE:
+        // The server only pads or swaps these
+        fmt->bps = 32;
+        fmt->is_float = 0;
+        break;
+    case PA_SAMPLE_FLOAT32LE:
+    case PA_SAMPLE_FLOAT32BE:
+        fmt->bps = 32;
+        fmt->is_float = 1;
+        break;
+    default:
+        // A-law and friends, let the server convert
+        break;
+    }
+    if (ss.rate) {
+        fmt->samplerate = ss.rate;
+    }
+    *conv = _convert_target(fmt, ss.format);
+    return 1;
+}
+
+/* Selects the kernel for @conv and sets pa_ss.format to its output, or turns conversion off */
+static void _convert_setup(enum convert_format conv)
+{
+    static const pa_sample_format_t formats[CONVERT_FORMATS] = {
+        [CONVERT_S16] = PA_SAMPLE_S16LE,
+        [CONVERT_S24_32] = PA_SAMPLE_S24_32LE,
+        [CONVERT_S24] = PA_SAMPLE_S24LE,
+    };
+    enum convert_isa isa = CONVERT_SCALAR;
+
+    convert_kernel = conv != CONVERT_NONE ? convert_select(conv, &isa) : NULL;
+    if (!convert_kernel) {
+        return;
+    }
+    convert_size = convert_sample_size(conv);
+    pa_ss.format = formats[conv];
+    log_info("Pulseaudio: converting float to %s in the plugin, %s kernel",
+            pa_sample_format_to_string(pa_ss.format), convert_isa_name(isa));
+}
+
+/* Sample spec of what the streamer delivers, float while converting */
+static void _streamer_spec(pa_sample_spec *ss)
+{
+    *ss = pa_ss;
+    if (convert_kernel) {
+        ss->format = PA_SAMPLE_FLOAT32LE;
+    }
+}
+
+static void _sink_cache_event(pa_context *c, pa_subscription_event_type_t type, uint32_t idx)
+{
+    pa_operation *o;
+
+    if (type == PA_SUBSCRIPTION_EVENT_REMOVE) {
+        _sink_cache_remove(idx);
+        return;
+    }
 
-    return _pa_wait_unlock(pa_stream_cork(pa_s, pause_, _pa_stream_success_cb, NULL));
+    o = pa_context_get_sink_info_by_index(c, idx, _sink_cache_info_cb,
+            type == PA_SUBSCRIPTION_EVENT_NEW ? SINK_INFO_NEW : SINK_INFO_UPDATE);
+    if (o)
+        pa_operation_unref(o);
 }
 
 static void _pa_ctx_subscription_cb(pa_context *ctx, pa_subscription_event_type_t t,
-        uint32_t idx, void *userdata)
+        uint32_t idx, void *userdata);
+
+static void _pa_sink_input_info_cb(pa_context *c, const pa_sink_input_info *i,
+        int eol, void *data);
+
+static void _reconnect_lost(void);
+
+static void _sink_input_query(void);
+
+static void _reconnect_done(void);
+
+static void _pa_context_running_cb(pa_context *c, void *data)
 {
-    pa_subscription_event_type_t type = t & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
-    if (type != PA_SUBSCRIPTION_EVENT_CHANGE)
+    const pa_context_state_t cs = pa_context_get_state(c);
+    pa_operation *op;
+
+    trace("pulse: context state has changed to %s\n", _pa_context_state_str(cs));
+
+    switch (cs) {
+    case PA_CONTEXT_READY:
+        pa_context_set_subscribe_callback(c, _pa_ctx_subscription_cb, NULL);
+        op = pa_context_subscribe(c, PA_SUBSCRIPTION_MASK_SINK_INPUT | PA_SUBSCRIPTION_MASK_SINK
+                | PA_SUBSCRIPTION_MASK_SERVER, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+
+        op = pa_context_get_server_info(c, _server_info_cb, NULL);
+        if (op)
+            pa_operation_unref(op);
+
+        op = pa_context_get_sink_info_list(c, _sink_cache_info_cb, SINK_INFO_LIST);
+        if (op)
+            pa_operation_unref(op);
+
+        if (reconnecting) {
+            _reconnect_done();
+        }
+        if (stream_pending) {
+            // pulse_play() returned before we were connected, start the stream now
+            stream_pending = 0;
+            int rc = _pa_stream_create(pending_pl);
+            pending_pl = NULL;
+            if (rc != OP_ERROR_SUCCESS) {
+                _state_set(OUTPUT_STATE_STOPPED);
+                deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+            }
+        }
+        pa_threaded_mainloop_signal(pa_ml, 0);
+        return;
+    case PA_CONTEXT_FAILED:
+    case PA_CONTEXT_TERMINATED:
+        // _pa_context_drop() clears this callback, so getting here means the server went away
+        if (reconnecting || (pa_s && deadbeef->conf_get_int(CONFSTR_PULSE_RECONNECT, PULSE_DEFAULT_RECONNECT))) {
+            _reconnect_lost();
+        } else if (stream_pending) {
+            log_err("Pulseaudio: Error creating context. Reason: %s", pa_strerror(pa_context_errno(c)));
+            stream_pending = 0;
+            _state_set(OUTPUT_STATE_STOPPED);
+            deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+        }
+        pa_threaded_mainloop_signal(pa_ml, 0);
+    default:
         return;
+    }
+}
+
+#ifdef DBPULSE_DEBUG
+static const char *_pa_stream_state_str(pa_stream_state_t s)
+{
+    switch (s) {
+    case PA_STREAM_CREATING:
+        return "PA_STREAM_CREATING";
+    case PA_STREAM_FAILED:
+        return "PA_STREAM_FAILED";
+    case PA_STREAM_READY:
+        return "PA_STREAM_READY";
+    case PA_STREAM_TERMINATED:
+        return "PA_STREAM_TERMINATED";
+    case PA_STREAM_UNCONNECTED:
+        return "PA_STREAM_UNCONNECTED";
+    }
 
-    if (pa_s && idx == pa_stream_get_index(pa_s))
-        pa_context_get_sink_input_info(ctx, idx, _pa_sink_input_info_cb, NULL);
+    return "unknown";
 }
+#endif
 
-static int _pa_create_context(void)
+static void _pa_stream_buffer_attr_cb(pa_stream *s, void *userdata)
 {
-    pa_mainloop_api	*api;
-    pa_proplist	*pl;
-    int		 rc;
+    const pa_buffer_attr *a = pa_stream_get_buffer_attr(s);
+    if (!a) {
+        return;
+    }
 
-    pl = _create_app_proplist();
+    log_info("Pulseaudio: negotiated buffer tlength %.1f ms, minreq %.1f ms, prebuf %.1f ms, maxlength %.1f ms",
+            pa_bytes_to_usec(a->tlength, &pa_ss) / 1000.0,
+            pa_bytes_to_usec(a->minreq, &pa_ss) / 1000.0,
+            pa_bytes_to_usec(a->prebuf, &pa_ss) / 1000.0,
+            pa_bytes_to_usec(a->maxlength, &pa_ss) / 1000.0);
+}
 
-    api = pa_threaded_mainloop_get_api(pa_ml);
-    BUG_ON(!api);
+static void _pa_stream_latency_cb(pa_stream *s, void *userdata)
+{
+    pa_usec_t usec;
+    int negative;
 
-    pa_threaded_mainloop_lock(pa_ml);
+    if (pa_stream_get_latency(s, &usec, &negative) < 0 || negative) {
+        return;
+    }
 
-    pa_ctx = pa_context_new_with_proplist(api, "DeaDBeeF Music Player", pl);
-    BUG_ON(!pa_ctx);
-    pa_proplist_free(pl);
+    if (!latency_logged) {
+        log_info("Pulseaudio: measured latency %.1f ms", usec / 1000.0);
+        latency_logged = 1;
+        latency_min = latency_max = usec;
+        latency_sum = usec;
+        latency_samples = 1;
+        return;
+    }
+    latency_sum += usec;
+    latency_samples++;
+    if (usec < latency_min) latency_min = usec;
+    if (usec > latency_max) latency_max = usec;
+}
 
-    pa_context_set_state_callback(pa_ctx, _pa_context_running_cb, NULL);
+static void _pa_stream_moved_cb(pa_stream *s, void *userdata)
+{
+    log_info("Pulseaudio: Stream moved to %s", pa_stream_get_device_name(s));
+}
 
-    // Read serveraddr from config
-    char server[1000];
-    deadbeef->conf_get_str (CONFSTR_PULSE_SERVERADDR, "", server, sizeof (server));
+/* The configured device is gone, recreate the stream on the default sink instead of stopping */
+static int _sink_fallback_retry(void)
+{
+    int err = pa_context_errno(pa_ctx);
+    pa_proplist *pl;
+
+    if (!stream_dev_named || !stream_pl || (err != PA_ERR_NOENTITY && err != PA_ERR_KILLED)) {
+        return 0;
+    }
+
+    log_info("Pulseaudio: Output device %s is not available (%s), falling back to the default sink",
+            preferred_sink, pa_strerror(err));
+    pl = pa_proplist_copy(stream_pl);
+    _pa_stream_detach();
+    sink_fallback = 1;
+    return _pa_stream_create(pl) == OP_ERROR_SUCCESS;
+}
+
+static void _iec_stream_ready(pa_stream *s);
+
+static void _pa_stream_running_cb(pa_stream *s, void *data)
+{
+    const pa_stream_state_t ss = pa_stream_get_state(s);
+
+    trace("pulse: stream state has changed to %s\n", _pa_stream_state_str(ss));
+
+    switch (ss) {
+    case PA_STREAM_FAILED:
+        if (_sink_fallback_retry()
+                || (!PA_CONTEXT_IS_GOOD(pa_context_get_state(pa_ctx))
+                    && deadbeef->conf_get_int(CONFSTR_PULSE_RECONNECT, PULSE_DEFAULT_RECONNECT))) {
+            // Context failures are handled by the reconnect logic in _pa_context_running_cb
+            pa_threaded_mainloop_signal(pa_ml, 0);
+            return;
+        }
+        log_err("Pulseaudio: Stopping playback. Reason: %s", pa_strerror(pa_context_errno(pa_ctx)));
+        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+        pa_threaded_mainloop_signal(pa_ml, 0);
+        return;
+    case PA_STREAM_READY:
+        {
+            _pa_stream_buffer_attr_cb(s, NULL);
+            _iec_stream_ready(s);
+            _sink_input_query();
+            _switch_uncork_ready();
+        }
+    case PA_STREAM_TERMINATED:
+        pa_threaded_mainloop_signal(pa_ml, 0);
+    default:
+        return;
+    }
+}
+
+/* Timers run on the mainloop thread, call these with the mainloop locked */
+static pa_time_event *_pa_timer_new(pa_usec_t usec, pa_time_event_cb_t cb)
+{
+    pa_mainloop_api *api = pa_threaded_mainloop_get_api(pa_ml);
+    struct timeval tv;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, usec);
+    return api->time_new(api, &tv, cb, NULL);
+}
+
+static void _pa_timer_free(pa_time_event **e)
+{
+    if (*e) {
+        pa_mainloop_api *api = pa_threaded_mainloop_get_api(pa_ml);
+        api->time_free(*e);
+        *e = NULL;
+    }
+}
+
+/*
+ * Volume and sink input info traffic. At most one volume operation is in
+ * flight, changes made meanwhile are folded into one follow-up carrying the
+ * latest value. Sink input change events only trigger an info query when
+ * none is running, and are deferred until PULSE_VOLUME_ECHO_MS after our own
+ * volume change was acknowledged, so its echo costs no extra round trip.
+ * All of this runs with the mainloop locked.
+ */
+
+/* Drops our reference to an operation once it has completed */
+static void _op_release(pa_operation **o)
+{
+    if (*o) {
+        pa_operation_unref(*o);
+        *o = NULL;
+    }
+}
+
+static int _op_running(pa_operation **o)
+{
+    if (*o && pa_operation_get_state(*o) != PA_OPERATION_RUNNING) {
+        _op_release(o);
+    }
+    return *o != NULL;
+}
+
+/* Forgets pending operations without running their callbacks */
+static void _op_cancel(pa_operation **o)
+{
+    if (*o) {
+        pa_operation_cancel(*o);
+        _op_release(o);
+    }
+}
+
+static void _volume_send(void);
+
+static void _volume_success_cb(pa_context *c, int success, void *userdata)
+{
+    _op_release(&volume_op);
+    volume_acked_usec = pa_rtclock_now();
+    if (volume_dirty) {
+        volume_dirty = 0;
+        _volume_send();
+    }
+}
+
+static void _volume_send(void)
+{
+    uint32_t idx;
+
+    if (iec_active) {
+        // The server keeps passthrough streams at 100%
+        return;
+    }
+    if (_op_running(&volume_op)) {
+        volume_dirty = 1;
+        STAT_ADD(volume_coalesced, 1);
+        return;
+    }
+    if (pa_cvolume_equal(&pa_vol, &volume_sent)) {
+        // Also stops volume_set_amp() in the info callback from echoing back
+        STAT_ADD(volume_unchanged, 1);
+        return;
+    }
+
+    idx = pa_stream_get_index(pa_s);
+    if (idx == PA_INVALID_INDEX) {
+        return;
+    }
+    volume_sent = pa_vol;
+    STAT_ADD(volume_ops, 1);
+    volume_op = pa_context_set_sink_input_volume(pa_ctx, idx, &pa_vol, _volume_success_cb, NULL);
+    _fan_volume();
+}
+
+static void _info_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _pa_timer_free(&info_timer);
+    _sink_input_query();
+}
+
+static void _sink_input_query(void)
+{
+    pa_usec_t since;
+
+    if (!pa_s || pa_stream_get_state(pa_s) != PA_STREAM_READY) {
+        return;
+    }
+    if (info_timer || _op_running(&info_op)) {
+        info_dirty = !info_timer;
+        STAT_ADD(info_suppressed, 1);
+        return;
+    }
+
+    since = pa_rtclock_now() - volume_acked_usec;
+    if (_op_running(&volume_op) || since < PULSE_VOLUME_ECHO_MS * PA_USEC_PER_MSEC) {
+        // Most likely the echo of our own change, look once things settled
+        info_timer = _pa_timer_new(_op_running(&volume_op) ? PULSE_VOLUME_ECHO_MS * PA_USEC_PER_MSEC
+                : PULSE_VOLUME_ECHO_MS * PA_USEC_PER_MSEC - since, _info_timer_cb);
+        STAT_ADD(info_suppressed, 1);
+        return;
+    }
+
+    STAT_ADD(info_queries, 1);
+    info_op = pa_context_get_sink_input_info(pa_ctx, pa_stream_get_index(pa_s), _pa_sink_input_info_cb, NULL);
+}
+
+static void _volume_reset(void)
+{
+    _op_cancel(&volume_op);
+    _op_cancel(&info_op);
+    _pa_timer_free(&info_timer);
+    volume_dirty = info_dirty = 0;
+    volume_acked_usec = 0;
+}
+
+/*
+ * Pause and unpause don't wait for the server. With a cork operation in
+ * flight a new request only records the wanted state, the completion
+ * callback then sends one more operation if it differs from the one that
+ * just finished, so spamming pause collapses into at most two round trips.
+ */
+static void _cork_send(int pause_);
+
+static void _cork_success_cb(pa_stream *s, int success, void *userdata)
+{
+    _op_release(&cork_op);
+    _stats_max(&stats.cork_usec_max, pa_rtclock_now() - cork_start_usec);
+    if (!success) {
+        log_err("Pulseaudio: Failed to %s stream. Reason: %s", cork_op_value ? "pause" : "unpause",
+                pa_strerror(pa_context_errno(pa_ctx)));
+    }
+    if (cork_want != cork_op_value) {
+        _cork_send(cork_want);
+    } else if (success && !cork_op_value && switch_drained_usec) {
+        _switch_uncorked();
+    }
+}
+
+/* Flushes and corks, or uncorks pa_s without waiting, call with the mainloop locked */
+static void _cork_send(int pause_)
+{
+    pa_operation *o;
+
+    cork_want = pause_;
+    if (_op_running(&cork_op)) {
+        STAT_ADD(cork_merged, 1);
+        return;
+    }
+
+    if (pause_) {
+        o = pa_stream_flush(pa_s, NULL, NULL);
+        if (o)
+            pa_operation_unref(o);
+    }
+    cork_op_value = pause_;
+    cork_start_usec = pa_rtclock_now();
+    STAT_ADD(cork_ops, 1);
+    cork_op = pa_stream_cork(pa_s, pause_, _cork_success_cb, NULL);
+    _fan_cork(pause_);
+}
+
+static void _pa_sink_input_info_cb(pa_context *c,
+                   const pa_sink_input_info *i,
+                   int eol,
+                   void *data)
+{
+    if (eol) {
+        _op_release(&info_op);
+        if (info_dirty) {
+            // More changes arrived while this query was running
+            info_dirty = 0;
+            _sink_input_query();
+        }
+        return;
+    }
+
+    if (i && plugin.has_volume && !iec_active) {
+        volume_sent = i->volume;
+        if (pa_cvolume_equal(&pa_vol, &i->volume)) {
+            STAT_ADD(volume_echoes, 1);
+            return;
+        }
+        memcpy(&pa_vol, &i->volume, sizeof(pa_vol));
+        pa_volume_t v = pa_cvolume_avg(&pa_vol);
+        if (v <= PA_VOLUME_NORM) {
+            deadbeef->volume_set_amp(pa_sw_volume_to_linear(v));
+        }
+    }
+}
+
+static void set_volume_value(void)
+{
+    pa_cvolume_set(&pa_vol, pa_ss.channels, pa_sw_volume_from_linear(deadbeef->volume_get_amp()));
+}
+
+static int set_volume()
+{
+    if (_state_get() == OUTPUT_STATE_STOPPED || !pa_s || !plugin.has_volume) {
+        return -OP_ERROR_INTERNAL;
+    }
+
+    STAT_ADD(volume_requests, 1);
+
+    pa_threaded_mainloop_lock(pa_ml);
+    if (!pa_s) {
+        pa_threaded_mainloop_unlock(pa_ml);
+        return -OP_ERROR_INTERNAL;
+    }
+    set_volume_value();
+    _volume_send();
+    pa_threaded_mainloop_unlock(pa_ml);
+
+    return OP_ERROR_SUCCESS;
+}
+
+static void _pa_ctx_subscription_cb(pa_context *ctx, pa_subscription_event_type_t t,
+        uint32_t idx, void *userdata)
+{
+    pa_subscription_event_type_t facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+    pa_subscription_event_type_t type = t & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
+    pa_operation *o;
+
+    switch (facility) {
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        _sink_cache_event(ctx, type, idx);
+        break;
+    case PA_SUBSCRIPTION_EVENT_SERVER:
+        // The default sink may have changed
+        o = pa_context_get_server_info(ctx, _server_info_cb, NULL);
+        if (o)
+            pa_operation_unref(o);
+        break;
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+        if (type != PA_SUBSCRIPTION_EVENT_CHANGE)
+            return;
+
+        if (pa_s && idx == pa_stream_get_index(pa_s)) {
+            _sink_input_query();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Starts connecting without waiting for the handshake, call with the mainloop locked */
+static int _pa_create_context(void)
+{
+    pa_mainloop_api	*api;
+    pa_proplist	*pl;
+    int		 rc;
+
+    pl = _create_app_proplist();
+
+    api = pa_threaded_mainloop_get_api(pa_ml);
+    BUG_ON(!api);
+
+    pa_ctx = pa_context_new_with_proplist(api, "DeaDBeeF Music Player", pl);
+    BUG_ON(!pa_ctx);
+    pa_proplist_free(pl);
+
+    pa_context_set_state_callback(pa_ctx, _pa_context_running_cb, NULL);
+
+    // Read serveraddr from config
+    char server[1000];
+    deadbeef->conf_get_str (CONFSTR_PULSE_SERVERADDR, "", server, sizeof (server));
+
+    rc = pa_context_connect(pa_ctx, *server ? server : NULL, PA_CONTEXT_NOFLAGS, NULL);
+    if (rc) {
+        log_err("Pulseaudio: Error creating context. Reason: %s", pa_strerror(pa_context_errno(pa_ctx)));
+        pa_context_set_state_callback(pa_ctx, NULL, NULL);
+        pa_context_unref(pa_ctx);
+        pa_ctx = NULL;
+        return -OP_ERROR_INTERNAL;
+    }
+
+    return OP_ERROR_SUCCESS;
+}
+
+/*
+ * Real-time mode for the threads that feed audio: the mainloop thread
+ * running the write callbacks and the prefetch thread. pulse2.realtime asks
+ * for SCHED_FIFO (or SCHED_RR with pulse2.rtpolicy 1) at pulse2.rtprio, and
+ * falls back to nice pulse2.nice when RLIMIT_RTPRIO or CAP_SYS_NICE do not
+ * allow that. pulse2.cpus ("2,3" or "0-3") pins the threads. The PCM
+ * buffers the plugin owns are mlocked, subject to RLIMIT_MEMLOCK. Every
+ * outcome is logged, none of them stops playback.
+ */
+
+/* Parses a CPU list like "0,2-3" into @set, returns the number of CPUs */
+static int _rt_parse_cpus(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+
+        if (end == list) {
+            list++;
+            continue;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list) last = first;
+        }
+        for (long cpu = first; cpu <= last && cpu >= 0 && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        list = end;
+    }
+    return CPU_COUNT(set);
+}
+
+/* Applies the configured priority and CPU set to the calling thread */
+static void _rt_setup(const char *who)
+{
+    struct sched_param sp = { 0 };
+    char cpus[256];
+    cpu_set_t set;
+    int policy, err, nice_;
+
+    if (!deadbeef->conf_get_int(CONFSTR_PULSE_REALTIME, PULSE_DEFAULT_REALTIME)) {
+        return;
+    }
+
+    policy = deadbeef->conf_get_int(CONFSTR_PULSE_RTPOLICY, PULSE_DEFAULT_RTPOLICY) ? SCHED_RR : SCHED_FIFO;
+    sp.sched_priority = deadbeef->conf_get_int(CONFSTR_PULSE_RTPRIO, PULSE_DEFAULT_RTPRIO);
+    if (sp.sched_priority < sched_get_priority_min(policy)) sp.sched_priority = sched_get_priority_min(policy);
+    if (sp.sched_priority > sched_get_priority_max(policy)) sp.sched_priority = sched_get_priority_max(policy);
+
+    // Children of this thread must not inherit RT scheduling
+    err = pthread_setschedparam(pthread_self(), policy | SCHED_RESET_ON_FORK, &sp);
+    if (!err) {
+        log_info("Pulseaudio: %s thread running %s priority %d", who,
+                policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", sp.sched_priority);
+    } else {
+        nice_ = deadbeef->conf_get_int(CONFSTR_PULSE_NICE, PULSE_DEFAULT_NICE);
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice_) == 0) {
+            log_info("Pulseaudio: %s thread real-time priority not permitted (%s), running at nice %d",
+                    who, strerror(err), nice_);
+        } else {
+            log_info("Pulseaudio: %s thread real-time priority (%s) and nice %d (%s) not permitted, "
+                    "running at normal priority", who, strerror(err), nice_, strerror(errno));
+        }
+    }
+
+    deadbeef->conf_get_str(CONFSTR_PULSE_CPUS, "", cpus, sizeof(cpus));
+    if (cpus[0]) {
+        if (!_rt_parse_cpus(cpus, &set)) {
+            log_err("Pulseaudio: no CPUs in %s \"%s\"", CONFSTR_PULSE_CPUS, cpus);
+        } else if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+            log_err("Pulseaudio: cannot pin %s thread to CPUs %s: %s", who, cpus, strerror(err));
+        } else {
+            log_info("Pulseaudio: %s thread pinned to CPUs %s", who, cpus);
+        }
+    }
+}
+
+/* Runs once on the mainloop thread after it started */
+static void _rt_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _pa_timer_free(&rt_timer);
+    _rt_setup("mainloop");
+}
+
+/* Keeps @size bytes at @p resident in real-time mode, failures only cost a log line */
+static void _rt_lock(void *p, size_t size)
+{
+    static int warned;
+
+    if (!p || !deadbeef->conf_get_int(CONFSTR_PULSE_REALTIME, PULSE_DEFAULT_REALTIME)) {
+        return;
+    }
+    if (mlock(p, size) < 0 && !warned) {
+        warned = 1;
+        log_info("Pulseaudio: cannot lock PCM buffers in memory: %s", strerror(errno));
+    }
+}
+
+/* Before freeing a buffer passed to _rt_lock(), harmless if it was not locked */
+static void _rt_unlock(void *p, size_t size)
+{
+    if (p) {
+        munlock(p, size);
+    }
+}
+
+/*
+ * Prefetch ring: a single producer/single consumer PCM buffer between a
+ * thread calling streamer_read and the stream write callback, so a slow
+ * decoder never blocks the mainloop thread. head and tail are running byte
+ * counts, only the producer moves head and only the consumer moves tail.
+ *
+ * A discard bumps gen and reads nothing until the producer acks it with
+ * the head it had at that point. Whatever lies below that head may have
+ * been read before the discard and is skipped, so a read that was in
+ * flight during a seek never plays. A format switch asks for a new size
+ * through want_size/want_frame_size along with a discard, the producer
+ * resizes data itself before acking, so it never has to be stopped.
+ */
+struct pcm_ring {
+    // Producer owned, the consumer only looks at them while synced
+    char *data;
+    size_t alloc;
+    size_t size;
+    size_t frame_size;
+    // Set by _ring_resize(), taken over by the producer on the next ack
+    size_t want_size;
+    size_t want_frame_size;
+    uint64_t head;
+    uint64_t tail;
+    // Bumped by _ring_discard(), acked by the producer with ack_head
+    uint32_t gen;
+    uint32_t ack_gen;
+    uint64_t ack_head;
+
+    // Consumer side statistics, only touched on the mainloop thread
+    uint64_t underruns;
+    uint64_t fill_sum;
+    uint64_t fill_samples;
+    size_t fill_min;
+    size_t fill_max;
+};
+
+static struct pcm_ring ring;
+static intptr_t ring_tid;
+static int ring_quit;
+static useconds_t ring_sleep_usec;
+
+/* Consumer: 0 while a discard is not acked yet, otherwise skips what was read before it */
+static int _ring_synced(struct pcm_ring *r)
+{
+    if (__atomic_load_n(&r->ack_gen, __ATOMIC_ACQUIRE) != __atomic_load_n(&r->gen, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    uint64_t ack = __atomic_load_n(&r->ack_head, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&r->tail, __ATOMIC_RELAXED) < ack) {
+        __atomic_store_n(&r->tail, ack, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+static size_t _ring_fill(struct pcm_ring *r)
+{
+    if (!_ring_synced(r)) {
+        return 0;
+    }
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    return head - tail;
+}
+
+/* Drops everything queued, consumer side like _ring_read() */
+static size_t _ring_discard(struct pcm_ring *r)
+{
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint64_t head;
+
+    __atomic_fetch_add(&r->gen, 1, __ATOMIC_ACQ_REL);
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    return head - tail;
+}
+
+/* Consumer: copies whole frames only, returns the number of bytes copied */
+static size_t _ring_read(struct pcm_ring *r, char *dst, size_t len)
+{
+    if (!_ring_synced(r)) {
+        return 0;
+    }
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    size_t avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+
+    if (len > avail) {
+        len = avail;
+    }
+    len -= len % r->frame_size;
+
+    size_t off = tail % r->size;
+    size_t first = r->size - off;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, r->data + off, first);
+    memcpy(dst + first, r->data, len - first);
+
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* Producer: applies the size asked for by _ring_resize(), the consumer skips all queued data anyway */
+static void _ring_apply_size(struct pcm_ring *r)
+{
+    size_t size = __atomic_load_n(&r->want_size, __ATOMIC_RELAXED);
+    size_t frame_size = __atomic_load_n(&r->want_frame_size, __ATOMIC_RELAXED);
+
+    if (size > r->alloc) {
+        _rt_unlock(r->data, r->alloc);
+        char *data = realloc(r->data, size);
+        if (data) {
+            r->data = data;
+            r->alloc = size;
+        } else {
+            // Prefetches less than pulse2.prefetch asks for
+            size = r->alloc - r->alloc % frame_size;
+        }
+        _rt_lock(r->data, r->alloc);
+    }
+    r->size = size;
+    r->frame_size = frame_size;
+}
+
+static void _ring_producer(void *ctx)
+{
+    struct pcm_ring *r = &ring;
+
+    _rt_setup("prefetch");
+
+    while (!__atomic_load_n(&ring_quit, __ATOMIC_ACQUIRE)) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        uint32_t gen = __atomic_load_n(&r->gen, __ATOMIC_ACQUIRE);
+
+        if (gen != __atomic_load_n(&r->ack_gen, __ATOMIC_RELAXED)) {
+            // Everything published so far predates the discard
+            _ring_apply_size(r);
+            __atomic_store_n(&r->ack_head, head, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->ack_gen, gen, __ATOMIC_RELEASE);
+        }
+        size_t space = r->size - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        size_t off = head % r->size;
+        size_t len = r->size - off;
+
+        if (len > space) {
+            len = space;
+        }
+        if (len > r->size / 4) {
+            len = r->size / 4;
+        }
+        len -= len % r->frame_size;
+
+        if (!len || _setformat_pending() || _state_get() != OUTPUT_STATE_PLAYING || !deadbeef->streamer_ok_to_read (-1)) {
+            usleep(ring_sleep_usec);
+            continue;
+        }
+
+        int bytesread = _streamer_read(r->data + off, len);
+        if (bytesread <= 0) {
+            usleep(ring_sleep_usec);
+            continue;
+        }
+        if (_setformat_pending()) {
+            // pulse_setformat() landed during the read, this is already the new format
+            continue;
+        }
+        if (gen != __atomic_load_n(&r->gen, __ATOMIC_ACQUIRE)) {
+            // Read from before a seek, published or not the consumer skips it
+            continue;
+        }
+        __atomic_store_n(&r->head, head + bytesread, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+            // Ran dry before this, an idle corked stream gets no write callbacks to notice the data
+            pa_threaded_mainloop_lock(pa_ml);
+            _autocork_resume();
+            pa_threaded_mainloop_unlock(pa_ml);
+        }
+    }
+}
+
+static void _ring_log_stats(void)
+{
+    if (!ring.fill_samples) {
+        return;
+    }
+    log_info("Pulseaudio: prefetch ring %zu bytes, fill min %zu avg %llu max %zu, underruns %llu",
+            ring.size, ring.fill_min, (unsigned long long)(ring.fill_sum / ring.fill_samples),
+            ring.fill_max, (unsigned long long)ring.underruns);
+}
+
+/* Ring size and frame size for @ms of the current streamer format */
+static void _ring_size(int ms, size_t *size, size_t *frame_size)
+{
+    pa_sample_spec ss;
+
+    _streamer_spec(&ss);
+    *frame_size = pa_frame_size(&ss);
+    *size = pa_usec_to_bytes(ms * PA_USEC_PER_MSEC, &ss);
+    if (*size < *frame_size * 4) {
+        *size = *frame_size * 4;
+    }
+}
+
+/* Sized from pulse2.prefetch milliseconds of streamer output, does nothing when that is 0 */
+static void _ring_start(void)
+{
+    int ms = deadbeef->conf_get_int(CONFSTR_PULSE_PREFETCH, PULSE_DEFAULT_PREFETCH);
+    if (ms <= 0 || ring_tid) {
+        // Disabled, or kept running across a reconnect or format switch
+        return;
+    }
+
+    memset(&ring, 0, sizeof(ring));
+    _ring_size(ms, &ring.size, &ring.frame_size);
+    ring.want_size = ring.alloc = ring.size;
+    ring.want_frame_size = ring.frame_size;
+    ring.fill_min = ring.size;
+    ring.data = malloc(ring.size);
+    if (!ring.data) {
+        return;
+    }
+    _rt_lock(ring.data, ring.size);
+
+    ring_sleep_usec = ms * 1000 / 8;
+    if (ring_sleep_usec < 1000) ring_sleep_usec = 1000;
+    if (ring_sleep_usec > 20000) ring_sleep_usec = 20000;
+
+    ring_quit = 0;
+    ring_tid = deadbeef->thread_start(_ring_producer, NULL);
+    if (!ring_tid) {
+        _rt_unlock(ring.data, ring.size);
+        free(ring.data);
+        ring.data = NULL;
+    }
+}
+
+/* Consumer: empties the ring and has the producer resize it for the current streamer format */
+static void _ring_resize(void)
+{
+    size_t size, frame_size;
+
+    if (!ring_tid) {
+        return;
+    }
+    _ring_size(deadbeef->conf_get_int(CONFSTR_PULSE_PREFETCH, PULSE_DEFAULT_PREFETCH), &size, &frame_size);
+    __atomic_store_n(&ring.want_size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring.want_frame_size, frame_size, __ATOMIC_RELAXED);
+    _ring_discard(&ring);
+}
+
+/*
+ * Call without the mainloop locked: the producer may be inside
+ * streamer_read(), which can call back into the plugin. The mainloop stops
+ * using the ring as soon as ring_tid is cleared.
+ */
+static void _ring_stop(void)
+{
+    intptr_t tid;
+
+    pa_threaded_mainloop_lock(pa_ml);
+    tid = ring_tid;
+    ring_tid = 0;
+    pa_threaded_mainloop_unlock(pa_ml);
+    if (!tid) {
+        return;
+    }
+
+    __atomic_store_n(&ring_quit, 1, __ATOMIC_RELEASE);
+    deadbeef->thread_join(tid);
+
+    _ring_log_stats();
+    _rt_unlock(ring.data, ring.alloc);
+    free(ring.data);
+    ring.data = NULL;
+}
+
+/*
+ * On a seek the audio queued in the server is from the old position. Flush
+ * it (and the prefetch ring) so the server asks for new data right away
+ * instead of playing out up to tlength first. The response time is measured
+ * from the seek event to the first write after the flush completed.
+ */
+static void _seek_flush_cb(pa_stream *s, int success, void *userdata)
+{
+    seek_flushed_usec = pa_rtclock_now();
+}
+
+static void _seek_flush(void)
+{
+    pa_operation *o;
+    size_t dropped = 0;
+
+    if (ring_tid) {
+        dropped = _ring_discard(&ring);
+        STAT_ADD(seek_dropped_bytes, dropped);
+    }
+    silence_run = 0;
+    carry_len = convert_carry = 0;
+    _fan_flush();
+
+    seek_start_usec = pa_rtclock_now();
+    seek_flushed_usec = 0;
+    o = pa_stream_flush(pa_s, _seek_flush_cb, NULL);
+    if (o)
+        pa_operation_unref(o);
+    else
+        seek_start_usec = 0;
+}
+
+/* Called from the write callback once the flush is through and new data went out */
+static void _seek_done(void)
+{
+    pa_usec_t now = pa_rtclock_now();
+    pa_usec_t usec = now - seek_start_usec;
+
+    STAT_ADD(seeks, 1);
+    STAT_ADD(seek_usec, usec);
+    _stats_max(&stats.seek_usec_max, usec);
+    log_info("Pulseaudio: seek response %.1f ms, flush took %.1f ms",
+            usec / 1000.0, (seek_flushed_usec - seek_start_usec) / 1000.0);
+    seek_start_usec = 0;
+}
+
+/* Must be called with the mainloop locked */
+static void _autocork_cancel(void)
+{
+    _pa_timer_free(&autocork_timer);
+    idle_corked = 0;
+    silence_run = 0;
+}
+
+/* Clears everything tied to pa_s and hands the stream back still connected, call with the mainloop locked */
+static pa_stream *_pa_stream_unhook(void)
+{
+    pa_stream *s = pa_s;
+
+    if (!s) {
+        return NULL;
+    }
+
+    _autocork_cancel();
+    _volume_reset();
+    _op_cancel(&cork_op);
+    seek_start_usec = seek_flushed_usec = 0;
+    _pa_timer_free(&adaptive_timer);
+    _pa_timer_free(&iec_timer);
+    iec_active = 0;
+    carry_len = convert_carry = 0;
+    switch_filling = 0;
+    _pa_timer_free(&switch_fill_timer);
+    if (latency_logged) {
+        log_info("Pulseaudio: measured latency min %.1f ms avg %.1f ms max %.1f ms", latency_min / 1000.0,
+                latency_sum / 1000.0 / latency_samples, latency_max / 1000.0);
+    }
+
+    pa_stream_set_state_callback(pa_s, NULL, NULL);
+    pa_stream_set_write_callback(pa_s, NULL, NULL);
+    pa_stream_set_event_callback(pa_s, NULL, NULL);
+    pa_stream_set_underflow_callback(pa_s, NULL, NULL);
+    pa_stream_set_overflow_callback(pa_s, NULL, NULL);
+    pa_stream_set_buffer_attr_callback(pa_s, NULL, NULL);
+    pa_stream_set_latency_update_callback(pa_s, NULL, NULL);
+    pa_stream_set_moved_callback(pa_s, NULL, NULL);
+    pa_s = NULL;
+    _fan_stop();
+    return s;
+}
+
+/* Disconnects pa_s but keeps the prefetch ring filling, call with the mainloop locked */
+static void _pa_stream_detach(void)
+{
+    pa_stream *s;
+
+    _switch_cancel();
+    s = _pa_stream_unhook();
+    if (s) {
+        pa_stream_disconnect(s);
+        pa_stream_unref(s);
+    }
+}
+
+/*
+ * Format switches use a standby stream. Once the last of the old format
+ * has been written, the old stream is moved to switch_old and drained
+ * while its replacement connects corked and prebuffers the new format.
+ * The replacement is uncorked as soon as the drain completes, so the gap
+ * is one uncork round trip instead of a teardown, a connect and a
+ * prebuffer. Everything here runs on the mainloop.
+ */
+static int _spec_setup(ddb_waveformat_t *fmt);
+
+/* Call with the mainloop locked */
+static void _switch_cancel(void)
+{
+    _op_cancel(&switch_drain_op);
+    if (!switch_old) {
+        return;
+    }
+    pa_stream_set_state_callback(switch_old, NULL, NULL);
+    pa_stream_disconnect(switch_old);
+    pa_stream_unref(switch_old);
+    switch_old = NULL;
+}
+
+static void _switch_uncork(void)
+{
+    switch_uncork = 0;
+    if (_state_get() != OUTPUT_STATE_PLAYING) {
+        // Paused meanwhile, unpausing uncorks the replacement
+        switch_drained_usec = 0;
+        return;
+    }
+    _cork_send(0);
+}
+
+/* Old stream drained, failed or went away */
+static void _switch_finish(void)
+{
+    if (!switch_old) {
+        return;
+    }
+    _switch_cancel();
+    switch_drained_usec = pa_rtclock_now();
+
+    if (!pa_s) {
+        switch_drained_usec = 0;
+    } else if (pa_stream_get_state(pa_s) == PA_STREAM_READY) {
+        _switch_uncork();
+    } else {
+        // Still connecting, see _switch_uncork_ready()
+        switch_uncork = 1;
+    }
+}
+
+/* Called when pa_s becomes ready */
+static void _switch_uncork_ready(void)
+{
+    if (switch_uncork) {
+        _switch_uncork();
+    }
+}
+
+/* Called when an uncork of pa_s completes */
+static void _switch_uncorked(void)
+{
+    pa_usec_t now = pa_rtclock_now();
+    pa_usec_t gap = now - switch_drained_usec;
+
+    log_info("Pulseaudio: format switch gap %.1f ms, %.1f ms from the request",
+            gap / 1000.0, (now - switch_start_usec) / 1000.0);
+    STAT_ADD(setformat_count, 1);
+    STAT_ADD(setformat_usec, gap);
+    _stats_max(&stats.setformat_usec_max, gap);
+    switch_drained_usec = 0;
+}
+
+static void _switch_drained_cb(pa_stream *s, int success, void *userdata)
+{
+    _op_release(&switch_drain_op);
+    _switch_finish();
+}
+
+static void _switch_old_state_cb(pa_stream *s, void *userdata)
+{
+    if (!PA_STREAM_IS_GOOD(pa_stream_get_state(s))) {
+        _switch_finish();
+    }
+}
+
+static void stream_request_cb(pa_stream *s, size_t requested_bytes, void *userdata);
+
+static void _switch_fill_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    size_t writable;
+
+    _pa_timer_free(&switch_fill_timer);
+    if (pa_s && (writable = pa_stream_writable_size(pa_s)) != (size_t)-1 && writable > 0) {
+        stream_request_cb(pa_s, writable, NULL);
+    }
+}
+
+/*
+ * The replacement of a standby switch starts while the prefetch ring is
+ * still empty. Silence written now would be its prebuffer, so until one
+ * request could be met in full it only gets what the ring holds and the
+ * rest is retried once the ring caught up. Returns how much of
+ * @requested_bytes to write now.
+ */
+static size_t _switch_prefill(size_t requested_bytes)
+{
+    size_t fill = _ring_fill(&ring);
+
+    if (fill >= requested_bytes) {
+        switch_filling = 0;
+        return requested_bytes;
+    }
+    if (!switch_fill_timer) {
+        switch_fill_timer = _pa_timer_new(ring_sleep_usec, _switch_fill_cb);
+    }
+    // frame_size is only stable once the producer acked, which a non-zero fill implies
+    return fill ? fill - fill % ring.frame_size : 0;
+}
+
+/* Starts a switch to requested_fmt from the write callback of pa_s, call with the mainloop locked */
+static void _switch_start(void)
+{
+    ddb_waveformat_t fmt;
+    pa_proplist *pl = pa_proplist_copy(stream_pl);
+    pa_stream *old;
+    // A corked stream never drains, and the server still asks it for data
+    int corked = _state_get() != OUTPUT_STATE_PLAYING || idle_corked;
+    int rc;
+
+    _switch_cancel();
+    switch_start_usec = pa_rtclock_now();
+    switch_drained_usec = 0;
+    switch_uncork = 0;
+
+    old = _pa_stream_unhook();
+    deadbeef->mutex_lock(fmt_mutex);
+    fmt = requested_fmt;
+    rc = _spec_setup(&fmt);
+    deadbeef->mutex_unlock(fmt_mutex);
+    // The producer stays parked while the request is pending, so whatever it reads
+    // after this is sized for the new format or dropped with the discard
+    _ring_resize();
+    __atomic_store_n(&_setformat_requested, 0, __ATOMIC_RELEASE);
+    if (rc < 0) {
+        log_err("Pulseaudio: unsupported format %d bit, stopping", fmt.bps);
+        pa_stream_disconnect(old);
+        pa_stream_unref(old);
+        pa_proplist_free(pl);
+        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+        return;
+    }
+
+    // pa_stream_create() starts the replacement corked while switch_old is set
+    switch_old = old;
+    pa_stream_set_state_callback(old, _switch_old_state_cb, NULL);
+    if (_pa_stream_create(pl) != OP_ERROR_SUCCESS) {
+        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+        return;
+    }
+    switch_filling = 1;
+    if (switch_old && corked) {
+        _switch_finish();
+    } else if (switch_old) {
+        switch_drain_op = pa_stream_drain(switch_old, _switch_drained_cb, NULL);
+        if (!switch_drain_op) {
+            _switch_finish();
+        }
+    }
+}
+
+static void _stats_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+/* Arms the periodic stats dump if pulse2.statsinterval is set, call with the mainloop locked */
+static void _stats_timer_arm(void)
+{
+    int interval = deadbeef->conf_get_int(CONFSTR_PULSE_STATSINTERVAL, PULSE_DEFAULT_STATSINTERVAL);
+
+    _pa_timer_free(&stats_timer);
+    if (interval > 0) {
+        stats_timer = _pa_timer_new(interval * PA_USEC_PER_SEC, _stats_timer_cb);
+    }
+}
+
+static void _stats_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _stats_dump();
+    _stats_timer_arm();
+}
+
+/* Must be called with the mainloop locked */
+static void _pa_context_drop(void)
+{
+    if (!pa_ctx) {
+        return;
+    }
+
+    pa_context_set_state_callback(pa_ctx, NULL, NULL);
+    pa_context_set_subscribe_callback(pa_ctx, NULL, NULL);
+    pa_context_disconnect(pa_ctx);
+    pa_context_unref(pa_ctx);
+    pa_ctx = NULL;
+
+    _sink_cache_clear();
+}
+
+/*
+ * Reconnect after losing the server while playing. The stream proplist is
+ * parked in pending_pl like a stream started before the context was ready,
+ * the prefetch ring keeps filling and the output stays playing, so playback
+ * resumes from the streamer position once the stream is back.
+ */
+static void _reconnect_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+static void _reconnect_schedule(void)
+{
+    pa_usec_t ms = PULSE_RECONNECT_MIN_MS << (reconnect_attempt < 6 ? reconnect_attempt : 6);
+    if (ms > PULSE_RECONNECT_MAX_MS) {
+        ms = PULSE_RECONNECT_MAX_MS;
+    }
+
+    trace("pulse: reconnect attempt %d in %d ms\n", reconnect_attempt + 1, (int)ms);
+    _pa_timer_free(&reconnect_timer);
+    reconnect_timer = _pa_timer_new(ms * PA_USEC_PER_MSEC, _reconnect_timer_cb);
+}
+
+static void _reconnect_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _pa_timer_free(&reconnect_timer);
+
+    reconnect_attempt++;
+    STAT_ADD(reconnect_attempts, 1);
+    if (_pa_create_context() != OP_ERROR_SUCCESS) {
+        _reconnect_schedule();
+    }
+}
+
+static void _reconnect_lost(void)
+{
+    if (!reconnecting) {
+        log_err("Pulseaudio: Lost connection to server. Reason: %s. Reconnecting", pa_strerror(pa_context_errno(pa_ctx)));
+        reconnecting = 1;
+        reconnect_attempt = 0;
+        reconnect_start_usec = pa_rtclock_now();
+        if (pa_s && !pending_pl) {
+            pending_pl = pa_proplist_copy(stream_pl);
+        }
+        _pa_stream_detach();
+        stream_pending = 1;
+    }
+
+    _pa_context_drop();
+    _reconnect_schedule();
+}
+
+static void _reconnect_done(void)
+{
+    pa_usec_t usec = pa_rtclock_now() - reconnect_start_usec;
+
+    STAT_ADD(reconnects, 1);
+    STAT_ADD(reconnect_usec, usec);
+    _stats_max(&stats.reconnect_usec_max, usec);
+    log_info("Pulseaudio: Reconnected after %d attempts in %.1f ms, %llu reconnects so far",
+            reconnect_attempt, usec / 1000.0, STAT(reconnects));
+    reconnecting = 0;
+}
+
+/* Stops a reconnect in progress, call with the mainloop locked */
+static void _reconnect_cancel(void)
+{
+    _pa_timer_free(&reconnect_timer);
+    if (reconnecting) {
+        log_info("Pulseaudio: Reconnect cancelled after %d attempts", reconnect_attempt);
+        reconnecting = 0;
+    }
+}
+
+static void _pa_idle_timeout_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _pa_timer_free(&idle_timer);
+
+    if (pa_s || stream_pending) {
+        return;
+    }
+
+    trace("pulse: no playback for a while, closing context\n");
+    _pa_context_drop();
+}
+
+/* Uncorks an idle corked stream, call with the mainloop locked once data is available again */
+static void _autocork_resume(void)
+{
+    if (!pa_s || !idle_corked || _state_get() != OUTPUT_STATE_PLAYING || _setformat_pending()) {
+        // Explicitly paused or gone, whoever uncorks next takes over
+        return;
+    }
+
+    trace("pulse: data available again, uncorking\n");
+    _autocork_cancel();
+    // The queued silence went with the cork, the stream prebuffers real data before it starts playing
+    _cork_send(0);
+}
+
+/*
+ * Armed by the write callback when a run of silence starts and dropped as
+ * soon as real data is written again, so firing means the stream has been
+ * silent for the whole idle timeout. Once corked the prefetch producer
+ * uncorks as soon as it reads data, without it nothing else notices the
+ * streamer has data again and the timer keeps checking once per timeout.
+ */
+static void _autocork_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _pa_timer_free(&autocork_timer);
+    if (!pa_s) {
+        return;
+    }
+
+    int ready = ring_tid ? _ring_fill(&ring) > 0 : deadbeef->streamer_ok_to_read (-1);
+    if (idle_corked) {
+        if (ready) {
+            _autocork_resume();
+        } else if (!ring_tid && _state_get() == OUTPUT_STATE_PLAYING) {
+            autocork_timer = _pa_timer_new(autocork_usec, _autocork_timer_cb);
+        }
+        return;
+    }
+
+    // Data that came in since the last write would not wake a corked stream, the next silent write arms it again
+    if (ready || !silence_run || switch_old || _setformat_pending() || _state_get() != OUTPUT_STATE_PLAYING) {
+        return;
+    }
+
+    trace("pulse: %zu bytes of silence, corking\n", silence_run);
+    // Through cork_op like a pause, so the fan-out streams cork too
+    _cork_send(1);
+    idle_corked = 1;
+    if (!ring_tid) {
+        autocork_timer = _pa_timer_new(autocork_usec, _autocork_timer_cb);
+    }
+}
+
+/*
+ * Adaptive buffering: grow tlength after an underrun, shrink it again after
+ * a stable period, staying within pulse2.adaptive_min/max milliseconds.
+ */
+static void _adaptive_set_tlength(pa_stream *s, size_t tlength, const char *reason)
+{
+    pa_operation *o;
+
+    if (tlength < adaptive_min_bytes) tlength = adaptive_min_bytes;
+    if (tlength > adaptive_max_bytes) tlength = adaptive_max_bytes;
+    tlength -= tlength % pa_frame_size(&pa_ss);
+    if (tlength == (size_t)buffer_size) {
+        return;
+    }
+
+    pa_buffer_attr attr = pa_attr;
+    attr.tlength = (uint32_t) tlength;
+    if (attr.prebuf != (uint32_t) -1 && attr.prebuf > attr.tlength) {
+        attr.prebuf = attr.tlength;
+    }
+
+    log_info("Pulseaudio: %s, buffer %llu ms -> %llu ms", reason,
+            (unsigned long long)(pa_bytes_to_usec(buffer_size, &pa_ss) / PA_USEC_PER_MSEC),
+            (unsigned long long)(pa_bytes_to_usec(tlength, &pa_ss) / PA_USEC_PER_MSEC));
+
+    o = pa_stream_set_buffer_attr(s, &attr, NULL, NULL);
+    if (o)
+        pa_operation_unref(o);
+    pa_attr = attr;
+    buffer_size = tlength;
+    adaptive_last_usec = pa_rtclock_now();
+}
+
+static void _pa_stream_underflow_cb(pa_stream *s, void *userdata)
+{
+    STAT_ADD(underruns, 1);
+    if (!adaptive_max_bytes) {
+        return;
+    }
+
+    // Starved upstream or idle, a bigger buffer would not help
+    if (_state_get() != OUTPUT_STATE_PLAYING || idle_corked || _setformat_pending()
+        || !deadbeef->streamer_ok_to_read (-1)) {
+        return;
+    }
+
+    if (pa_rtclock_now() - adaptive_last_usec < PULSE_ADAPTIVE_HOLDOFF_MS * PA_USEC_PER_MSEC) {
+        // Previous adjustment has not settled yet
+        return;
+    }
+
+    _adaptive_set_tlength(s, buffer_size + buffer_size / 2, "underrun");
+}
+
+static void _pa_stream_overflow_cb(pa_stream *s, void *userdata)
+{
+    STAT_ADD(overruns, 1);
+}
+
+static void _adaptive_timer_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    _pa_timer_free(&adaptive_timer);
+    if (!pa_s) {
+        return;
+    }
+
+    if (_state_get() == OUTPUT_STATE_PLAYING && !idle_corked
+        && pa_rtclock_now() - adaptive_last_usec >= PULSE_ADAPTIVE_STABLE_MS * PA_USEC_PER_MSEC) {
+        _adaptive_set_tlength(pa_s, buffer_size - buffer_size / 8, "stable");
+    }
+
+    adaptive_timer = _pa_timer_new(PULSE_ADAPTIVE_STABLE_MS / 4 * PA_USEC_PER_MSEC, _adaptive_timer_cb);
+}
+
+static void
+stream_event_cb(pa_stream *p, const char *name, pa_proplist *pl, void *userdata)
+{
+    if (!pa_s || !deadbeef->conf_get_int (CONFSTR_PULSE_PAUSEONCORK, PULSE_DEFAULT_PAUSEONCORK)) {
+        return;
+    }
+
+    if (!strcmp(name, PA_STREAM_EVENT_REQUEST_CORK) && _state_move(OUTPUT_STATE_PLAYING, OUTPUT_STATE_PAUSED)) {
+        __atomic_store_n(&cork_requested, 1, __ATOMIC_RELEASE);
+        // Same paths as pulse_pause()/pulse_unpause(), so cork_op and the fan-out stay in step
+        if (switch_old) {
+            _switch_finish();
+        } else {
+            _cork_send(1);
+        }
+        deadbeef->sendmessage(DB_EV_PAUSED, 0, 1, 0);
+    } else if (!strcmp(name, PA_STREAM_EVENT_REQUEST_UNCORK) && __atomic_exchange_n(&cork_requested, 0, __ATOMIC_ACQ_REL)
+               && _state_move(OUTPUT_STATE_PAUSED, OUTPUT_STATE_PLAYING)) {
+        _autocork_cancel();
+        if (switch_old) {
+            _switch_finish();
+        } else {
+            _cork_send(0);
+        }
+        deadbeef->sendmessage(DB_EV_PAUSED, 0, 0, 0);
+    }
+}
+
+/* Fills one begin_write chunk from the prefetch ring, padding with silence if it runs dry */
+static int _ring_fill_chunk(char *buffer, size_t bufsize)
+{
+    size_t fill = _ring_fill(&ring);
+
+    ring.fill_sum += fill;
+    ring.fill_samples++;
+    if (fill < ring.fill_min) ring.fill_min = fill;
+    if (fill > ring.fill_max) ring.fill_max = fill;
+
+    size_t bytesread = _ring_read(&ring, buffer, bufsize);
+    if (bytesread < bufsize) {
+        // Old format data is drained before a format change, running dry then is expected
+        if (!_setformat_pending()) {
+            ring.underruns++;
+        }
+        memset (buffer + bytesread, 0, bufsize - bytesread);
+        STAT_ADD(silence_bytes, bufsize - bytesread);
+    }
+    if (bytesread > 0) {
+        silence_run = 0;
+    } else {
+        silence_run += bufsize;
+    }
+    if (unlikely(play_start_usec) && bytesread > 0) {
+        log_info("Pulseaudio: time to first audio %.1f ms", (pa_rtclock_now() - play_start_usec) / 1000.0);
+        play_start_usec = 0;
+    }
+    return bufsize;
+}
+
+/*
+ * IEC 61937 passthrough. DeaDBeeF only hands out PCM, but S/PDIF wav files
+ * carrying AC-3, DTS or MPEG audio in IEC 61937 bursts decode to 16 bit
+ * stereo that really is an encoded stream. With pulse2.passthrough on, the
+ * first PULSE_IEC61937_PROBE_MS of such a stream are scanned for a burst
+ * preamble. On a hit the stream is recreated with pa_stream_new_extended()
+ * offering the encoding first and PCM second; the server picks the first
+ * one the sink accepts, so a sink without passthrough goes on playing the
+ * bursts as PCM like before. A passthrough stream keeps being scanned and
+ * goes back to PCM once the bursts stop. Chunks are muted while a switch is
+ * pending so the wrong kind of stream never plays them. Runs on the
+ * mainloop thread.
+ */
+
+/* Encoding for the data type in burst info word Pc */
+static pa_encoding_t _iec_encoding(unsigned pc)
+{
+    switch (pc & 0x1f) {
+    case 0x01:
+        return PA_ENCODING_AC3_IEC61937;
+    case 0x04:
+    case 0x05:
+    case 0x06:
+    case 0x08:
+    case 0x09:
+        return PA_ENCODING_MPEG_IEC61937;
+    case 0x07:
+        return PA_ENCODING_MPEG2_AAC_IEC61937;
+    case 0x0b:
+    case 0x0c:
+    case 0x0d:
+        return PA_ENCODING_DTS_IEC61937;
+    case 0x15:
+        return PA_ENCODING_EAC3_IEC61937;
+    default:
+        return PA_ENCODING_INVALID;
+    }
+}
+
+/* Encoding of the first burst in @buffer, bursts start on a frame with Pa, Pb little endian */
+static pa_encoding_t _iec_find(const unsigned char *buffer, size_t bytes)
+{
+    for (size_t i = 0; i + 8 <= bytes; i += 4) {
+        const unsigned char *b = buffer + i;
+        if (b[0] == 0x72 && b[1] == 0xf8 && b[2] == 0x1f && b[3] == 0x4e
+                && (b[6] || b[7])) {
+            pa_encoding_t e = _iec_encoding(b[4] | b[5] << 8);
+            if (e != PA_ENCODING_INVALID) {
+                return e;
+            }
+        }
+    }
+    return PA_ENCODING_INVALID;
+}
+
+/* Decides whether the stream about to be created gets scanned, call from _pa_stream_create() */
+static void _iec_scan_start(void)
+{
+    iec_scan = !convert_kernel && pa_ss.format == PA_SAMPLE_S16LE && pa_ss.channels == 2
+        && deadbeef->conf_get_int(CONFSTR_PULSE_PASSTHROUGH, PULSE_DEFAULT_PASSTHROUGH);
+    iec_probe_bytes = iec_scan ? pa_usec_to_bytes(PULSE_IEC61937_PROBE_MS * PA_USEC_PER_MSEC, &pa_ss) : 0;
+    iec_since = 0;
+}
+
+/* Offers iec_encoding and PCM, in that order */
+static pa_stream *_iec_stream_new(pa_proplist *pl)
+{
+    pa_format_info *formats[2];
+    pa_stream *s;
+
+    formats[0] = pa_format_info_new();
+    formats[0]->encoding = iec_encoding;
+    pa_format_info_set_rate(formats[0], pa_ss.rate);
+    pa_format_info_set_channels(formats[0], pa_ss.channels);
+    formats[1] = pa_format_info_from_sample_spec(&pa_ss, &pa_cmap);
+
+    s = pa_stream_new_extended(pa_ctx, NULL, formats, 2, pl);
+
+    pa_format_info_free(formats[0]);
+    pa_format_info_free(formats[1]);
+    return s;
+}
+
+static void _iec_stream_ready(pa_stream *s)
+{
+    const pa_format_info *f;
+
+    if (iec_encoding == PA_ENCODING_INVALID) {
+        return;
+    }
+    f = pa_stream_get_format_info(s);
+    iec_active = f && !pa_format_info_is_pcm(f);
+    if (iec_active) {
+        log_info("Pulseaudio: %s passthrough", pa_encoding_to_string(iec_encoding));
+    } else {
+        log_info("Pulseaudio: sink does not accept %s, playing it as PCM", pa_encoding_to_string(iec_encoding));
+    }
+}
+
+static void _iec_switch_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+    pa_proplist *pl;
+
+    _pa_timer_free(&iec_timer);
+    if (!pa_s || !stream_pl) {
+        return;
+    }
+    pl = pa_proplist_copy(stream_pl);
+    _pa_stream_detach();
+    if (_pa_stream_create(pl) != OP_ERROR_SUCCESS) {
+        deadbeef->sendmessage(DB_EV_STOP, 0, 0, 0);
+    }
+}
+
+/* Recreates the stream for @encoding once the current write callback is done */
+static void _iec_switch(pa_encoding_t encoding)
+{
+    if (encoding == PA_ENCODING_INVALID) {
+        log_info("Pulseaudio: %s bursts stopped, back to PCM", pa_encoding_to_string(iec_encoding));
+    } else {
+        log_info("Pulseaudio: %s bursts found, offering passthrough", pa_encoding_to_string(encoding));
+    }
+    iec_encoding = encoding;
+    iec_timer = _pa_timer_new(0, _iec_switch_cb);
+}
+
+/* Looks at a chunk about to be written, muting it if it is for the other kind of stream */
+static void _iec_check(char *buffer, size_t bytes)
+{
+    pa_encoding_t found;
+
+    if (iec_timer) {
+        memset(buffer, 0, bytes);
+        return;
+    }
+    if (iec_encoding == PA_ENCODING_INVALID && !iec_probe_bytes) {
+        // Plain PCM past the probe window
+        return;
+    }
+
+    found = _iec_find((const unsigned char *)buffer, bytes);
+    iec_probe_bytes = iec_probe_bytes > bytes ? iec_probe_bytes - bytes : 0;
+    if (found == PA_ENCODING_INVALID) {
+        iec_since += bytes;
+        if (iec_encoding != PA_ENCODING_INVALID && !iec_probe_bytes
+                && iec_since >= pa_usec_to_bytes(PULSE_IEC61937_PROBE_MS * PA_USEC_PER_MSEC, &pa_ss)) {
+            _iec_switch(PA_ENCODING_INVALID);
+        }
+        return;
+    }
+
+    iec_since = 0;
+    if (found != iec_encoding) {
+        _iec_switch(found);
+        memset(buffer, 0, bytes);
+    }
+}
+
+/* Fills up to @bufsize bytes of streamer output from the ring, the streamer or silence */
+static int _fill_chunk(char *buffer, size_t bufsize)
+{
+    int bytesread;
+
+    if (ring_tid && _state_get() == OUTPUT_STATE_PLAYING) {
+        bytesread = _ring_fill_chunk(buffer, bufsize);
+    } else if (_setformat_pending() || _state_get() != OUTPUT_STATE_PLAYING || !deadbeef->streamer_ok_to_read (-1)) {
+        memset (buffer, 0, bufsize);
+        bytesread = bufsize;
+        STAT_ADD(silence_bytes, bufsize);
+        silence_run += bufsize;
+    } else {
+        bytesread = _streamer_read(buffer, bufsize);
+        if (bytesread < 0) {
+            bytesread = 0;
+        }
+        if (bytesread > 0) {
+            silence_run = 0;
+        }
+        if (unlikely(play_start_usec) && bytesread > 0) {
+            log_info("Pulseaudio: time to first audio %.1f ms", (pa_rtclock_now() - play_start_usec) / 1000.0);
+            play_start_usec = 0;
+        }
+    }
+    return bytesread;
+}
+
+/*
+ * Like _fill_chunk() but reads float into convert_buf and converts it into
+ * @buffer. A short read can end mid frame, those bytes stay at the start of
+ * convert_buf (convert_carry) and are completed by the next read.
+ */
+static int _convert_chunk(char *buffer, size_t bufsize)
+{
+    size_t frame = sizeof(float) * pa_ss.channels;
+    size_t samples = bufsize / (convert_size * pa_ss.channels) * pa_ss.channels;
+    size_t filled;
+
+    if (!samples) {
+        return 0;
+    }
+    if (samples > convert_buf_samples) {
+        // Grows to the largest request once, then stays
+        _rt_unlock(convert_buf, convert_buf_samples * sizeof(float));
+        float *buf = realloc(convert_buf, samples * sizeof(float));
+        if (!buf) {
+            memset (buffer, 0, bufsize);
+            return bufsize;
+        }
+        convert_buf = buf;
+        convert_buf_samples = samples;
+        _rt_lock(convert_buf, samples * sizeof(float));
+    }
+
+    filled = convert_carry + _fill_chunk((char *)convert_buf + convert_carry, samples * sizeof(float) - convert_carry);
+    samples = filled / frame * pa_ss.channels;
+    convert_kernel(buffer, convert_buf, samples);
+    convert_carry = filled - samples * sizeof(float);
+    memmove(convert_buf, convert_buf + samples, convert_carry);
+    return samples * convert_size;
+}
+
+/*
+ * Fan-out: pulse2.fanout names up to PULSE_FANOUT_MAX more sinks that play
+ * the same audio as pa_s. Each source chunk is read once into fan.data and
+ * every stream's write callback copies from there into its own write
+ * buffer, each with its own read position. Reader 0 is pa_s. The fastest
+ * reader pulls new data in; a reader falling a whole buffer behind loses
+ * the oldest audio rather than holding everyone up. fan.head only moves
+ * by whole frames, a partial one waits in fan.carry. Everything runs on
+ * the mainloop thread, so no locking is needed.
+ */
+
+struct fan_reader {
+    pa_stream *s;
+    uint64_t pos;
+    char sink[256];
+};
+
+static struct {
+    char *data;
+    size_t size;
+    uint64_t head;
+    char carry[PA_CHANNELS_MAX * 4];
+    size_t carry_len;
+    int count;
+    struct fan_reader readers[PULSE_FANOUT_MAX + 1];
+} fan;
+
+/* Moves readers that would lose data once fan.head grows by @len up to the oldest byte kept */
+static void _fan_make_room(size_t len)
+{
+    for (int i = 0; i < fan.count; i++) {
+        struct fan_reader *r = &fan.readers[i];
+        if (r->s && fan.head + len - r->pos > fan.size) {
+            uint64_t pos = fan.head + len - fan.size;
+            STAT_ADD(fanout_skip_bytes, pos - r->pos);
+            r->pos = pos;
+        }
+    }
+}
+
+/* Reads from the source until fan.head reaches @target or the source runs dry */
+static void _fan_produce(uint64_t target)
+{
+    size_t frame = pa_frame_size(&pa_ss);
+
+    while (fan.head < target) {
+        size_t off = fan.head % fan.size;
+        size_t len = target - fan.head;
+        size_t filled = fan.carry_len;
+        int n;
+
+        if (len > fan.size - off) {
+            len = fan.size - off;
+        }
+        len -= len % frame;
+        if (!len) {
+            break;
+        }
+        _fan_make_room(len);
+        memcpy(fan.data + off, fan.carry, filled);
+        n = convert_kernel ? _convert_chunk(fan.data + off + filled, len - filled)
+            : _fill_chunk(fan.data + off + filled, len - filled);
+        if (n <= 0) {
+            break;
+        }
+        filled += n;
+        fan.carry_len = filled % frame;
+        memcpy(fan.carry, fan.data + off + filled - fan.carry_len, fan.carry_len);
+        fan.head += filled - fan.carry_len;
+    }
+}
+
+/* Copies up to @bufsize bytes for @r, silence if the source has nothing */
+static int _fan_read(struct fan_reader *r, char *buffer, size_t bufsize)
+{
+    size_t avail, off, first;
+
+    if (fan.head - r->pos < bufsize) {
+        _fan_produce(r->pos + bufsize);
+    }
+    avail = fan.head - r->pos;
+    if (avail > bufsize) {
+        avail = bufsize;
+    }
+    if (!avail) {
+        memset (buffer, 0, bufsize);
+        STAT_ADD(silence_bytes, bufsize);
+        return bufsize;
+    }
+
+    off = r->pos % fan.size;
+    first = avail < fan.size - off ? avail : fan.size - off;
+    memcpy(buffer, fan.data + off, first);
+    memcpy(buffer + first, fan.data, avail - first);
+    r->pos += avail;
+    return avail;
+}
 
-    rc = pa_context_connect(pa_ctx, *server ? server : NULL, PA_CONTEXT_NOFLAGS, NULL);
-    if (rc)
-        goto out_fail;
+static void _fan_request_cb(pa_stream *s, size_t requested_bytes, void *userdata)
+{
+    struct fan_reader *r = userdata;
+    ssize_t buftotal = requested_bytes;
 
-    for (;;) {
-        pa_context_state_t state;
-        state = pa_context_get_state(pa_ctx);
-        if (state == PA_CONTEXT_READY)
-            break;
-        if (!PA_CONTEXT_IS_GOOD(state))
-            goto out_fail_connected;
-        pa_threaded_mainloop_wait(pa_ml);
+    while (buftotal > 0) {
+        void *buffer = NULL;
+        size_t bufsize = buftotal;
+        if (pa_stream_begin_write(s, &buffer, &bufsize) < 0) {
+            return;
+        }
+        int bytesread = _fan_read(r, buffer, bufsize);
+        pa_stream_write(s, buffer, bytesread, NULL, 0LL, PA_SEEK_RELATIVE);
+        buftotal -= bytesread;
     }
+}
 
-    pa_context_set_subscribe_callback(pa_ctx, _pa_ctx_subscription_cb, NULL);
-    pa_operation *op = pa_context_subscribe(pa_ctx, PA_SUBSCRIPTION_MASK_SINK_INPUT,
-            NULL, NULL);
-    if (!op)
-        goto out_fail_connected;
-    pa_operation_unref(op);
-
-    pa_threaded_mainloop_unlock(pa_ml);
+static void _fan_reader_drop(struct fan_reader *r)
+{
+    pa_stream_set_state_callback(r->s, NULL, NULL);
+    pa_stream_set_write_callback(r->s, NULL, NULL);
+    pa_stream_disconnect(r->s);
+    pa_stream_unref(r->s);
+    r->s = NULL;
+}
 
-    return OP_ERROR_SUCCESS;
+static void _fan_state_cb(pa_stream *s, void *userdata)
+{
+    struct fan_reader *r = userdata;
 
-out_fail_connected:
-    pa_context_disconnect(pa_ctx);
+    if (pa_stream_get_state(s) == PA_STREAM_FAILED) {
+        // The other sinks play on
+        log_err("Pulseaudio: fan-out to %s failed. Reason: %s", r->sink, pa_strerror(pa_context_errno(pa_ctx)));
+        _fan_reader_drop(r);
+    }
+}
 
-out_fail:
-    log_err("Pulseaudio: Error creating context. Reason: %s", pa_strerror(pa_context_errno(pa_ctx)));
-    pa_context_unref(pa_ctx);
-    pa_ctx = NULL;
+/* Opens the pulse2.fanout streams next to pa_s, call at the end of _pa_stream_create() */
+static void _fan_start(pa_stream_flags_t flags)
+{
+    char conf[1024];
+    char *save = NULL;
+    int ms;
 
-    pa_threaded_mainloop_unlock(pa_ml);
+    deadbeef->conf_get_str(CONFSTR_PULSE_FANOUT, "", conf, sizeof(conf));
+    if (!conf[0]) {
+        return;
+    }
 
-    return -OP_ERROR_INTERNAL;
+    ms = deadbeef->conf_get_int(CONFSTR_PULSE_BUFFERSIZE, PULSE_DEFAULT_BUFFERSIZE) * 4;
+    if (ms < PULSE_FANOUT_MIN_MS) ms = PULSE_FANOUT_MIN_MS;
+    fan.size = pa_usec_to_bytes(ms * PA_USEC_PER_MSEC, &pa_ss);
+    fan.data = malloc(fan.size);
+    if (!fan.data) {
+        return;
+    }
+    _rt_lock(fan.data, fan.size);
+    fan.head = 0;
+    fan.count = 1;
+    fan.readers[0].s = pa_s;
+    fan.readers[0].pos = 0;
+    snprintf(fan.readers[0].sink, sizeof(fan.readers[0].sink), "%s", stream_dev_named ? preferred_sink : "default");
+
+    // Always keep the timing info current, it is how drift is measured
+    flags |= PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+    for (char *name = strtok_r(conf, ", ", &save); name && fan.count <= PULSE_FANOUT_MAX;
+            name = strtok_r(NULL, ", ", &save)) {
+        struct fan_reader *r = &fan.readers[fan.count];
+
+        r->s = pa_stream_new_with_proplist(pa_ctx, NULL, &pa_ss, &pa_cmap, stream_pl);
+        if (!r->s) {
+            log_err("Pulseaudio: Error creating fan-out stream for %s. Reason: %s", name,
+                    pa_strerror(pa_context_errno(pa_ctx)));
+            continue;
+        }
+        r->pos = 0;
+        snprintf(r->sink, sizeof(r->sink), "%s", name);
+        pa_stream_set_state_callback(r->s, _fan_state_cb, r);
+        pa_stream_set_write_callback(r->s, _fan_request_cb, r);
+        if (pa_stream_connect_playback(r->s, name, &pa_attr, flags,
+                    plugin.has_volume ? &pa_vol : NULL, NULL) < 0) {
+            log_err("Pulseaudio: Error connecting fan-out stream to %s. Reason: %s", name,
+                    pa_strerror(pa_context_errno(pa_ctx)));
+            _fan_reader_drop(r);
+            continue;
+        }
+        fan.count++;
+    }
+    log_info("Pulseaudio: fanning out to %d sinks, %zu byte buffer", fan.count, fan.size);
 }
 
-static void
-stream_event_cb(pa_stream *p, const char *name, pa_proplist *pl, void *userdata)
+static void _fan_stop(void)
 {
-    if (!pa_s || !deadbeef->conf_get_int (CONFSTR_PULSE_PAUSEONCORK, PULSE_DEFAULT_PAUSEONCORK)) {
-        return;
+    for (int i = 1; i < fan.count; i++) {
+        if (fan.readers[i].s) {
+            _fan_reader_drop(&fan.readers[i]);
+        }
     }
+    _rt_unlock(fan.data, fan.size);
+    free(fan.data);
+    memset(&fan, 0, sizeof(fan));
+}
 
-    if (!strcmp(name, PA_STREAM_EVENT_REQUEST_CORK) && state != OUTPUT_STATE_PAUSED) {
-        cork_requested = 1;
-        pa_stream_flush(pa_s, NULL, NULL);
-        pa_stream_cork(pa_s, 1, NULL, NULL);
-        state = OUTPUT_STATE_PAUSED;
-        deadbeef->sendmessage(DB_EV_PAUSED, 0, 1, 0);
-    } else if (!strcmp(name, PA_STREAM_EVENT_REQUEST_UNCORK) && cork_requested) {
-        cork_requested = 0;
-        pa_stream_cork(pa_s, 0, NULL, NULL);
-        state = OUTPUT_STATE_PLAYING;
-        deadbeef->sendmessage(DB_EV_PAUSED, 0, 0, 0);
+static void _fan_cork(int pause_)
+{
+    pa_operation *o;
+
+    for (int i = 1; i < fan.count; i++) {
+        pa_stream *s = fan.readers[i].s;
+        if (!s) {
+            continue;
+        }
+        if (pause_) {
+            o = pa_stream_flush(s, NULL, NULL);
+            if (o)
+                pa_operation_unref(o);
+        }
+        o = pa_stream_cork(s, pause_, NULL, NULL);
+        if (o)
+            pa_operation_unref(o);
     }
 }
 
-static void _setformat_apply (void *ctx) {
-    deadbeef->mutex_lock(mutex);
+static void _fan_volume(void)
+{
+    pa_operation *o;
 
-    state = OUTPUT_STATE_STOPPED;
+    for (int i = 1; i < fan.count; i++) {
+        pa_stream *s = fan.readers[i].s;
+        if (!s || pa_stream_get_index(s) == PA_INVALID_INDEX) {
+            continue;
+        }
+        o = pa_context_set_sink_input_volume(pa_ctx, pa_stream_get_index(s), &pa_vol, NULL, NULL);
+        if (o)
+            pa_operation_unref(o);
+    }
+}
 
-    pa_threaded_mainloop_lock(pa_ml);
-    pa_stream_disconnect(pa_s);
+/* Drops what was read ahead for every stream and flushes the extra ones, pa_s is flushed by the caller */
+static void _fan_flush(void)
+{
+    pa_operation *o;
 
-    while (pa_stream_get_state(pa_s) != PA_STREAM_TERMINATED) {
-        pa_threaded_mainloop_wait(pa_ml);
+    for (int i = 0; i < fan.count; i++) {
+        struct fan_reader *r = &fan.readers[i];
+        if (!r->s) {
+            continue;
+        }
+        if (i == 0) {
+            STAT_ADD(seek_dropped_bytes, fan.head - r->pos);
+        } else {
+            o = pa_stream_flush(r->s, NULL, NULL);
+            if (o)
+                pa_operation_unref(o);
+        }
+        r->pos = fan.head;
     }
+    fan.carry_len = 0;
+}
 
-    pa_stream_unref(pa_s);
-    pa_s = NULL;
+/* Position of what @r's sink plays right now, in usec of fan.data */
+static int _fan_heard(struct fan_reader *r, int64_t *usec)
+{
+    pa_usec_t latency;
+    int negative = 0;
 
-    pa_threaded_mainloop_unlock(pa_ml);
+    if (!r->s || pa_stream_get_latency(r->s, &latency, &negative) < 0) {
+        return -1;
+    }
+    *usec = (int64_t)pa_bytes_to_usec(r->pos, &pa_ss) - (negative ? -(int64_t)latency : (int64_t)latency);
+    return 0;
+}
 
-    pulse_set_spec(&requested_fmt);
+/* Logs each extra sink's offset from pa_s, from the streams' timing info, call with the mainloop locked */
+static void _fan_drift_log(void)
+{
+    int64_t ref, heard;
 
-    deadbeef->mutex_unlock(mutex);
+    if (fan.count < 2 || _fan_heard(&fan.readers[0], &ref) < 0) {
+        return;
+    }
+    for (int i = 1; i < fan.count; i++) {
+        if (_fan_heard(&fan.readers[i], &heard) == 0) {
+            log_info("Pulseaudio: fan-out sink %s is %+.1f ms from %s", fan.readers[i].sink,
+                    (heard - ref) / 1000.0, fan.readers[0].sink);
+        }
+    }
+}
+
+/* One read from whichever source feeds pa_s */
+static int _source_read(char *buffer, size_t bufsize)
+{
+    if (fan.count) {
+        return _fan_read(&fan.readers[0], buffer, bufsize);
+    } else if (convert_kernel) {
+        return _convert_chunk(buffer, bufsize);
+    }
+    return _fill_chunk(buffer, bufsize);
+}
 
-    _setformat_requested = 0;
+/*
+ * Fills as much of one begin_write buffer as the source has, so a request
+ * normally costs a single write even when streamer_read returns short.
+ * A trailing partial frame is kept in carry and goes out first next time.
+ * Returns the number of bytes to write, always whole frames.
+ */
+static size_t _fill_frames(char *buffer, size_t bufsize)
+{
+    size_t frame = pa_frame_size(&pa_ss);
+    size_t filled = carry_len;
+
+    memcpy(buffer, carry, carry_len);
+    carry_len = 0;
+    while (bufsize - filled >= frame) {
+        int bytesread = _source_read(buffer + filled, bufsize - filled);
+        if (bytesread <= 0) {
+            break;
+        }
+        filled += bytesread;
+    }
 
-    deadbeef->thread_detach (_setformat_tid);
-    _setformat_tid = 0;
-    trace("Pulseaudio: _setformat_apply end\n");
+    carry_len = filled % frame;
+    memcpy(carry, buffer + filled - carry_len, carry_len);
+    return filled - carry_len;
 }
 
 static void stream_request_cb(pa_stream *s, size_t requested_bytes, void *userdata) {
     char *buffer = NULL;
     ssize_t buftotal = requested_bytes;
-    int bytesread;
+    size_t bytesread;
+    int writes = 0;
+    pa_usec_t start = pa_rtclock_now();
+
+    if (unlikely(_setformat_pending()) && (!ring_tid || !_ring_fill(&ring))) {
+        // All of the old format is with the server, s drains while its replacement connects
+        _switch_start();
+        return;
+    }
+    if (unlikely(switch_filling) && ring_tid && _state_get() == OUTPUT_STATE_PLAYING) {
+        requested_bytes = buftotal = _switch_prefill(requested_bytes);
+        if (!requested_bytes) {
+            return;
+        }
+    }
+
     // trace("Pulseaudio: buftotal preloop %zd\n", buftotal);
     while (buftotal > 0)  {
         size_t bufsize = buftotal;
         pa_stream_begin_write(s, (void**) &buffer, &bufsize);
         // trace("Pulseaudio: bufsize begin write %zu\n", bufsize);
 
-        if (_setformat_requested || state != OUTPUT_STATE_PLAYING || !deadbeef->streamer_ok_to_read (-1)) {
-            memset (buffer, 0, bufsize);
-            bytesread = bufsize;
-        } else {
-            bytesread = deadbeef->streamer_read(buffer, bufsize);
-            if (bytesread < 0) {
-                bytesread = 0;
-            }
+        bytesread = _fill_frames(buffer, bufsize);
+        if (unlikely(iec_scan)) {
+            _iec_check(buffer, bytesread);
         }
         pa_stream_write(s, buffer, bytesread, NULL, 0LL, PA_SEEK_RELATIVE);
+        writes++;
+        if (unlikely(seek_flushed_usec) && bytesread > 0 && _state_get() == OUTPUT_STATE_PLAYING) {
+            _seek_done();
+            seek_flushed_usec = 0;
+        }
 
         buftotal -= bytesread;
         // trace("Pulseaudio: buftotal %zd\n", buftotal);
     }
 
-    if (_setformat_requested && !_setformat_tid) {
-        _setformat_tid = deadbeef->thread_start (_setformat_apply, NULL);
+    STAT_ADD(callbacks, 1);
+    STAT_ADD(writes, writes);
+    STAT_ADD(bytes_written, requested_bytes);
+    _stats_max(&stats.writes_max, writes);
+    _stats_hist_add(stats.callback_hist, pa_rtclock_now() - start);
+
+    if (autocork_usec && !idle_corked) {
+        if (!silence_run) {
+            _pa_timer_free(&autocork_timer);
+        } else if (!autocork_timer) {
+            autocork_timer = _pa_timer_new(autocork_usec, _autocork_timer_cb);
+        }
     }
 }
 
@@ -527,26 +3238,47 @@ static int pulse_init(void)
     trace ("pulse_init\n");
     int rc;
 
-    state = OUTPUT_STATE_STOPPED;
+    if (pa_ml) {
+        // Already connected or connecting
+        return OP_ERROR_SUCCESS;
+    }
+
+    _state_set(OUTPUT_STATE_STOPPED);
 
     if (requested_fmt.samplerate != 0) {
         memcpy (&plugin.fmt, &requested_fmt, sizeof (ddb_waveformat_t));
     }
 
-    pa_ml = pa_threaded_mainloop_new();
-    BUG_ON(!pa_ml);
+    pa_threaded_mainloop *ml = pa_threaded_mainloop_new();
+    BUG_ON(!ml);
 
-    rc = pa_threaded_mainloop_start(pa_ml);
+    rc = pa_threaded_mainloop_start(ml);
     if (rc) {
-        pa_threaded_mainloop_free(pa_ml);
+        pa_threaded_mainloop_free(ml);
         ret_pa_error(rc);
     }
 
+    // The stats action reads pa_ml under mutex, see pulse_action_dump_stats()
+    deadbeef->mutex_lock(mutex);
+    pa_ml = ml;
+    deadbeef->mutex_unlock(mutex);
+
     trace("Pulseaudio: create context\n");
-    if (_pa_create_context() != OP_ERROR_SUCCESS) {
+    pa_threaded_mainloop_lock(pa_ml);
+    rc = _pa_create_context();
+    if (rc == OP_ERROR_SUCCESS) {
+        _stats_timer_arm();
+        rt_timer = _pa_timer_new(0, _rt_timer_cb);
+    }
+    pa_threaded_mainloop_unlock(pa_ml);
+
+    if (rc != OP_ERROR_SUCCESS) {
+        deadbeef->mutex_lock(mutex);
+        pa_threaded_mainloop_stop(pa_ml);
         pa_threaded_mainloop_free(pa_ml);
         pa_ml = NULL;
-        return OP_ERROR_INTERNAL;
+        deadbeef->mutex_unlock(mutex);
+        return -OP_ERROR_INTERNAL;
     }
 
     return OP_ERROR_SUCCESS;
@@ -554,10 +3286,23 @@ static int pulse_init(void)
 
 static int pulse_setformat (ddb_waveformat_t *fmt)
 {
+    ddb_waveformat_t native = *fmt;
+    enum convert_format conv;
+
+    int native_ok = fmt->channels && _native_format(&native, &conv);
+
     deadbeef->mutex_lock(mutex);
-    if (state != OUTPUT_STATE_STOPPED)
-        _setformat_requested = 1;
+    deadbeef->mutex_lock(fmt_mutex);
+    if (_state_get() != OUTPUT_STATE_STOPPED && native_ok
+        && native.bps == plugin.fmt.bps && native.is_float == plugin.fmt.is_float
+        && native.samplerate == plugin.fmt.samplerate && native.channels == plugin.fmt.channels
+        && native.channelmask == plugin.fmt.channelmask) {
+        // Negotiates to what the stream already runs at, the streamer converts
+        trace("Pulseaudio: format change absorbed by the native format\n");
+    } else if (_state_get() != OUTPUT_STATE_STOPPED)
+        __atomic_store_n(&_setformat_requested, 1, __ATOMIC_RELEASE);
     memcpy (&requested_fmt, fmt, sizeof (ddb_waveformat_t));
+    deadbeef->mutex_unlock(fmt_mutex);
     deadbeef->mutex_unlock(mutex);
     return 0;
 }
@@ -566,40 +3311,55 @@ static int pulse_free(void)
 {
     trace("pulse_free\n");
 
-    state = OUTPUT_STATE_STOPPED;
+    __atomic_store_n(&_setformat_requested, 0, __ATOMIC_RELEASE);
+    _state_set(OUTPUT_STATE_STOPPED);
     if (!pa_ml) {
         return OP_ERROR_SUCCESS;
     }
 
+    _meta_cancel();
     pa_threaded_mainloop_lock(pa_ml);
 
-    if (pa_s) {
-        pa_stream_disconnect(pa_s);
-        pa_stream_unref(pa_s);
-        pa_s = NULL;
+    _pa_timer_free(&idle_timer);
+    _pa_timer_free(&stats_timer);
+    _pa_timer_free(&rt_timer);
+    _reconnect_cancel();
+    _pa_stream_detach();
+    _pa_context_drop();
+    stream_pending = 0;
+    if (pending_pl) {
+        pa_proplist_free(pending_pl);
+        pending_pl = NULL;
     }
-
-    if (pa_ctx) {
-        pa_context_disconnect(pa_ctx);
-        pa_context_unref(pa_ctx);
-        pa_ctx = NULL;
+    if (stream_pl) {
+        pa_proplist_free(stream_pl);
+        stream_pl = NULL;
     }
+    _rt_unlock(convert_buf, convert_buf_samples * sizeof(float));
+    free(convert_buf);
+    convert_buf = NULL;
+    convert_buf_samples = 0;
+    convert_carry = 0;
 
     pa_threaded_mainloop_unlock(pa_ml);
+    _ring_stop();
 
+    deadbeef->mutex_lock(mutex);
     if (pa_ml) {
         pa_threaded_mainloop_stop(pa_ml);
         pa_threaded_mainloop_free(pa_ml);
         pa_ml = NULL;
     }
+    deadbeef->mutex_unlock(mutex);
 
     return OP_ERROR_SUCCESS;
 }
 
-static int pulse_set_spec(ddb_waveformat_t *fmt)
+/* Derives plugin.fmt, pa_ss, pa_cmap and the volume for @fmt, -1 if the sample size is not supported */
+static int _spec_setup(ddb_waveformat_t *fmt)
 {
-    pa_proplist	*pl;
-    int rc;
+    ddb_waveformat_t track;
+    enum convert_format conv = CONVERT_NONE;
 
     memcpy (&plugin.fmt, fmt, sizeof (ddb_waveformat_t));
     if (!plugin.fmt.channels) {
@@ -610,6 +3370,13 @@ static int pulse_set_spec(ddb_waveformat_t *fmt)
         plugin.fmt.samplerate = 44100;
         plugin.fmt.channelmask = 3;
     }
+    iec_encoding = PA_ENCODING_INVALID;
+    track = plugin.fmt;
+    if (_native_format(&plugin.fmt, &conv)) {
+        log_info("Pulseaudio: negotiated sink format %d bit %s %d Hz for track format %d bit %s %d Hz",
+                plugin.fmt.bps, plugin.fmt.is_float ? "float" : "int", plugin.fmt.samplerate,
+                track.bps, track.is_float ? "float" : "int", track.samplerate);
+    }
     if (plugin.fmt.samplerate > PA_RATE_MAX) {
         plugin.fmt.samplerate = PA_RATE_MAX;
     }
@@ -647,7 +3414,22 @@ static int pulse_set_spec(ddb_waveformat_t *fmt)
     default:
         return -1;
     };
+    _convert_setup(conv);
+
+    if (plugin.has_volume) {
+        set_volume_value();
+    }
+    return 0;
+}
 
+static int pulse_set_spec(ddb_waveformat_t *fmt)
+{
+    pa_proplist	*pl;
+    int rc;
+
+    if (_spec_setup(fmt) < 0) {
+        return -1;
+    }
 
     pl = _create_stream_proplist();
     pa_proplist *songpl = get_stream_prop_song(NULL);
@@ -656,88 +3438,188 @@ static int pulse_set_spec(ddb_waveformat_t *fmt)
 
     pa_threaded_mainloop_lock(pa_ml);
 
+    _state_move(OUTPUT_STATE_STOPPED, OUTPUT_STATE_PLAYING);
+    if (!pa_ctx || pa_context_get_state(pa_ctx) != PA_CONTEXT_READY) {
+        // Still connecting, the context state callback creates the stream when ready
+        trace("Pulseaudio: context not ready, deferring stream creation\n");
+        if (pending_pl) {
+            pa_proplist_free(pending_pl);
+        }
+        pending_pl = pl;
+        stream_pending = 1;
+        pa_threaded_mainloop_unlock(pa_ml);
+        return OP_ERROR_SUCCESS;
+    }
+
+    rc = _pa_stream_create(pl);
+    pa_threaded_mainloop_unlock(pa_ml);
+
+    if (rc != OP_ERROR_SUCCESS) {
+        _state_set(OUTPUT_STATE_STOPPED);
+    }
+    return rc;
+}
+
+/* Creates and connects pa_s without waiting for it to become ready, call with the mainloop locked */
+static int _pa_stream_create(pa_proplist *pl)
+{
+    int rc;
+
     trace("Pulseaudio: create stream\n");
-    pa_s = pa_stream_new_with_proplist(pa_ctx, NULL, &pa_ss, &pa_cmap, pl);
-    pa_proplist_free(pl);
+    if (iec_encoding != PA_ENCODING_INVALID) {
+        pa_s = _iec_stream_new(pl);
+    } else {
+        pa_s = pa_stream_new_with_proplist(pa_ctx, NULL, &pa_ss, &pa_cmap, pl);
+    }
+    if (stream_pl) {
+        pa_proplist_free(stream_pl);
+    }
+    stream_pl = pl;
     if (!pa_s) {
-        pa_threaded_mainloop_unlock(pa_ml);
+        log_err("Pulseaudio: Error creating stream. Reason: %s", pa_strerror(pa_context_errno(pa_ctx)));
         ret_pa_last_error();
     }
 
     pa_stream_set_state_callback(pa_s, _pa_stream_running_cb, NULL);
     pa_stream_set_write_callback(pa_s, stream_request_cb, NULL);
     pa_stream_set_event_callback(pa_s, stream_event_cb, NULL);
+    pa_stream_set_moved_callback(pa_s, _pa_stream_moved_cb, NULL);
+
+    _ring_start();
+    _iec_scan_start();
+
+    int corkms = deadbeef->conf_get_int(CONFSTR_PULSE_AUTOCORK, PULSE_DEFAULT_AUTOCORK);
+    autocork_usec = corkms > 0 ? corkms * PA_USEC_PER_MSEC : 0;
 
     int ms = deadbeef->conf_get_int(CONFSTR_PULSE_BUFFERSIZE, PULSE_DEFAULT_BUFFERSIZE);
     if (ms < 0) ms = 100;
+
+    pa_stream_set_underflow_callback(pa_s, _pa_stream_underflow_cb, NULL);
+    pa_stream_set_overflow_callback(pa_s, _pa_stream_overflow_cb, NULL);
+
+    adaptive_min_bytes = adaptive_max_bytes = 0;
+    if (deadbeef->conf_get_int(CONFSTR_PULSE_ADAPTIVE, PULSE_DEFAULT_ADAPTIVE)) {
+        int minms = deadbeef->conf_get_int(CONFSTR_PULSE_ADAPTIVE_MIN, PULSE_DEFAULT_ADAPTIVE_MIN);
+        int maxms = deadbeef->conf_get_int(CONFSTR_PULSE_ADAPTIVE_MAX, PULSE_DEFAULT_ADAPTIVE_MAX);
+        if (minms < 1) minms = 1;
+        if (maxms < minms) maxms = minms;
+        if (ms < minms) ms = minms;
+        if (ms > maxms) ms = maxms;
+        adaptive_min_bytes = pa_usec_to_bytes(minms * PA_USEC_PER_MSEC, &pa_ss);
+        adaptive_max_bytes = pa_usec_to_bytes(maxms * PA_USEC_PER_MSEC, &pa_ss);
+        adaptive_last_usec = pa_rtclock_now();
+        adaptive_timer = _pa_timer_new(PULSE_ADAPTIVE_STABLE_MS / 4 * PA_USEC_PER_MSEC, _adaptive_timer_cb);
+    }
+
     buffer_size = pa_usec_to_bytes(ms * 1000, &pa_ss);
 
-    pa_buffer_attr attr = {
-        .maxlength = (uint32_t) -1,
-        .tlength = (uint32_t) buffer_size,
-        .prebuf = (uint32_t) -1,
-        .minreq = (uint32_t) -1,
-    };
+    pa_attr.maxlength = (uint32_t) -1;
+    pa_attr.tlength = (uint32_t) buffer_size;
+    pa_attr.prebuf = (uint32_t) -1;
+    pa_attr.minreq = (uint32_t) -1;
+    pa_attr.fragsize = (uint32_t) -1;
 
-    if (plugin.has_volume) {
-        set_volume_value();
+    int minreq = deadbeef->conf_get_int(CONFSTR_PULSE_MINREQ, PULSE_DEFAULT_MINREQ);
+    if (minreq > 0) {
+        pa_attr.minreq = pa_usec_to_bytes(minreq * PA_USEC_PER_MSEC, &pa_ss);
+    }
+    int prebuf = deadbeef->conf_get_int(CONFSTR_PULSE_PREBUF, PULSE_DEFAULT_PREBUF);
+    if (prebuf >= 0) {
+        pa_attr.prebuf = pa_usec_to_bytes(prebuf * PA_USEC_PER_MSEC, &pa_ss);
+        if (pa_attr.prebuf > pa_attr.tlength) {
+            pa_attr.prebuf = pa_attr.tlength;
+        }
     }
 
-    deadbeef->conf_lock ();
-    const char *dev = deadbeef->conf_get_str_fast (PULSE_PLUGIN_ID "_soundcard", "default");
+    pa_stream_flags_t flags = _state_get() == OUTPUT_STATE_PAUSED || switch_old ? PA_STREAM_START_CORKED : PA_STREAM_NOFLAGS;
+    if (deadbeef->conf_get_int(CONFSTR_PULSE_LOWLATENCY, PULSE_DEFAULT_LOWLATENCY)) {
+        flags |= PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+    } else if (_timing_wanted()) {
+        // Keeps the playback clock current, see _pa_clock_read()
+        flags |= PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+    }
 
-    // TODO: Handle case of configured device no longer existing, fallback to default
+    latency_logged = 0;
+    pa_stream_set_buffer_attr_callback(pa_s, _pa_stream_buffer_attr_cb, NULL);
+    pa_stream_set_latency_update_callback(pa_s, _pa_stream_latency_cb, NULL);
+
+    const char *dev = NULL;
+    deadbeef->conf_get_str (PULSE_PLUGIN_ID "_soundcard", "default", preferred_sink, sizeof (preferred_sink));
+    if (!_sink_is_default(preferred_sink)) {
+        if (sink_fallback) {
+            // Retrying after the device failed, see _sink_fallback_retry()
+        } else if (_sink_cache_missing(preferred_sink)) {
+            log_info("Pulseaudio: Output device %s is not available, using the default sink", preferred_sink);
+        } else {
+            dev = preferred_sink;
+        }
+    }
+    sink_fallback = 0;
+    stream_dev_named = dev != NULL;
 
+    // The stream starts out with this volume
+    volume_sent = pa_vol;
     rc = pa_stream_connect_playback(pa_s,
-                    (!strcmp(dev, "default")) ? NULL: dev,
-                    &attr,
-                    PA_STREAM_NOFLAGS,
-                    plugin.has_volume ? &pa_vol : NULL,
+                    dev,
+                    &pa_attr,
+                    flags,
+                    plugin.has_volume && iec_encoding == PA_ENCODING_INVALID ? &pa_vol : NULL,
                     NULL);
-    deadbeef->conf_unlock ();
-
-    if (rc)
-        goto out_fail;
 
-    pa_threaded_mainloop_wait(pa_ml);
-
-    if (pa_stream_get_state(pa_s) != PA_STREAM_READY) {
+    if (rc) {
         log_err("Pulseaudio: Error creating stream. Please check output device.");
-        goto out_fail;
+        // The ring goes with the stop or free that follows
+        _pa_stream_detach();
+        ret_pa_last_error();
     }
 
-    pa_context_get_sink_input_info(pa_ctx, pa_stream_get_index(pa_s),
-            _pa_sink_input_info_cb, NULL);
-
-    pa_threaded_mainloop_unlock(pa_ml);
-
-
+    _fan_start(flags);
+    if (fan.count) {
+        // Bursts would have to be found once per sink, fan-out plays PCM
+        iec_scan = 0;
+    }
 
-    state = OUTPUT_STATE_PLAYING;
     return OP_ERROR_SUCCESS;
-
-out_fail:
-    pa_stream_unref(pa_s);
-    pa_s = NULL;
-
-    pa_threaded_mainloop_unlock(pa_ml);
-
-
-
-    ret_pa_last_error();
 }
 
 static int pulse_play(void)
 {
     trace ("pulse_play\n");
 
+    __atomic_store_n(&_setformat_requested, 0, __ATOMIC_RELEASE);
+    _state_set(OUTPUT_STATE_STOPPED);
+
     if (!pa_ml) {
         if (pulse_init() != OP_ERROR_SUCCESS) {
             return -OP_ERROR_INTERNAL;
         }
+    } else {
+        // Persistent connection, reuse the context unless it went away while idle
+        int rc = OP_ERROR_SUCCESS;
+
+        pa_threaded_mainloop_lock(pa_ml);
+        _pa_timer_free(&idle_timer);
+        _reconnect_cancel();
+        _pa_stream_detach();
+        if (!pa_ctx || !PA_CONTEXT_IS_GOOD(pa_context_get_state(pa_ctx))) {
+            _pa_context_drop();
+            rc = _pa_create_context();
+        }
+        pa_threaded_mainloop_unlock(pa_ml);
+        _ring_stop();
+
+        if (rc != OP_ERROR_SUCCESS) {
+            pulse_free();
+            return -OP_ERROR_INTERNAL;
+        }
     }
 
+    play_start_usec = pa_rtclock_now();
+
     deadbeef->mutex_lock(mutex);
+    if (requested_fmt.samplerate != 0) {
+        memcpy (&plugin.fmt, &requested_fmt, sizeof (ddb_waveformat_t));
+    }
     int ret = pulse_set_spec(&plugin.fmt);
     deadbeef->mutex_unlock(mutex);
     if (ret != OP_ERROR_SUCCESS) {
@@ -748,37 +3630,98 @@ static int pulse_play(void)
 
 static int pulse_stop(void)
 {
-    pulse_free();
+    if (!pa_ml || !deadbeef->conf_get_int(CONFSTR_PULSE_PERSISTENT, PULSE_DEFAULT_PERSISTENT)) {
+        pulse_free();
+        return OP_ERROR_SUCCESS;
+    }
+
+    trace("pulse_stop: keeping context\n");
+    __atomic_store_n(&_setformat_requested, 0, __ATOMIC_RELEASE);
+    _state_set(OUTPUT_STATE_STOPPED);
+
+    int timeout = deadbeef->conf_get_int(CONFSTR_PULSE_IDLETIMEOUT, PULSE_DEFAULT_IDLETIMEOUT);
+
+    pa_threaded_mainloop_lock(pa_ml);
+    _reconnect_cancel();
+    _pa_stream_detach();
+    stream_pending = 0;
+    if (pending_pl) {
+        pa_proplist_free(pending_pl);
+        pending_pl = NULL;
+    }
+    _pa_timer_free(&idle_timer);
+    if (timeout > 0) {
+        idle_timer = _pa_timer_new(timeout * PA_USEC_PER_SEC, _pa_idle_timeout_cb);
+    }
+    pa_threaded_mainloop_unlock(pa_ml);
+    _ring_stop();
 
     return OP_ERROR_SUCCESS;
 }
 
+/* A stream exists or is still connecting */
+static int _stream_active(void)
+{
+    int active;
+
+    if (!pa_ml) {
+        return 0;
+    }
+    pa_threaded_mainloop_lock(pa_ml);
+    active = pa_s || stream_pending;
+    pa_threaded_mainloop_unlock(pa_ml);
+    return active;
+}
+
 static int pulse_pause(void)
 {
-    if (!pa_s) {
+    if (!_stream_active()) {
         pulse_play();
     }
 
-    state = OUTPUT_STATE_PAUSED;
-    _pa_stream_flush();
-    return _pa_stream_cork(1);
+    _state_move(OUTPUT_STATE_PLAYING, OUTPUT_STATE_PAUSED);
+    if (!pa_ml) {
+        return OP_ERROR_SUCCESS;
+    }
+    pa_threaded_mainloop_lock(pa_ml);
+    if (switch_old) {
+        // Drops the rest of the old format, the replacement is still corked
+        _switch_finish();
+    } else if (pa_s) {
+        // Otherwise the pending stream is created corked
+        _cork_send(1);
+    }
+    pa_threaded_mainloop_unlock(pa_ml);
+    return OP_ERROR_SUCCESS;
 }
 
 static int pulse_unpause(void)
 {
-    if (!pa_s) {
+    if (!_stream_active()) {
         pulse_play();
     }
 
-    state = OUTPUT_STATE_PLAYING;
-    cork_requested=0;
-    return _pa_stream_cork(0);
+    _state_move(OUTPUT_STATE_PAUSED, OUTPUT_STATE_PLAYING);
+    __atomic_store_n(&cork_requested, 0, __ATOMIC_RELEASE);
+    if (!pa_ml) {
+        return OP_ERROR_SUCCESS;
+    }
+    pa_threaded_mainloop_lock(pa_ml);
+    _autocork_cancel();
+    if (switch_old) {
+        // The old stream was corked when the switch started and will not drain, take the replacement
+        _switch_finish();
+    } else if (pa_s) {
+        _cork_send(0);
+    }
+    pa_threaded_mainloop_unlock(pa_ml);
+    return OP_ERROR_SUCCESS;
 }
 
 
 static int pulse_get_state(void)
 {
-    return state;
+    return _state_get();
 }
 
 
@@ -786,13 +3729,20 @@ static int pulse_get_state(void)
 static int pulse_plugin_start(void)
 {
     mutex = deadbeef->mutex_create();
+    fmt_mutex = deadbeef->mutex_create();
+    sinks_mutex = deadbeef->mutex_create();
     tfbytecode = deadbeef->tf_compile("[%artist% - ]%title%");
+    _meta_start();
     return 0;
 }
 
 static int pulse_plugin_stop(void)
 {
+    pulse_free();
+    _meta_stop();
     deadbeef->mutex_free(mutex);
+    deadbeef->mutex_free(fmt_mutex);
+    deadbeef->mutex_free(sinks_mutex);
     deadbeef->tf_free(tfbytecode);
     return 0;
 }
@@ -803,19 +3753,25 @@ DB_plugin_t * pulse2_load(DB_functions_t *api)
     return DB_PLUGIN (&plugin);
 }
 
-static void proplistupdate_success_cb(pa_stream *s, int success, void *userdata)
-{
-    pa_proplist_free(userdata);
-}
-
 static int
 pulse_message (uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2) {
     switch (id) {
     case DB_EV_SONGSTARTED:
-        if (state == OUTPUT_STATE_PLAYING) {
-            pa_proplist *pl = get_stream_prop_song(((ddb_event_track_t *)ctx)->track);
+        if (_state_get() == OUTPUT_STATE_PLAYING && pa_s && ((ddb_event_track_t *)ctx)->track) {
+            pa_usec_t start = pa_rtclock_now();
+            _meta_post(((ddb_event_track_t *)ctx)->track);
+            STAT_ADD(meta_events, 1);
+            _stats_max(&stats.meta_handler_usec_max, pa_rtclock_now() - start);
+        }
+        break;
+    case DB_EV_SEEKED:
+        if (pa_s && _state_get() != OUTPUT_STATE_STOPPED
+            && deadbeef->conf_get_int(CONFSTR_PULSE_SEEKFLUSH, PULSE_DEFAULT_SEEKFLUSH)) {
             pa_threaded_mainloop_lock(pa_ml);
-            _pa_nowait_unlock(pa_stream_proplist_update (pa_s, PA_UPDATE_REPLACE, pl, proplistupdate_success_cb, pl));
+            if (pa_s) {
+                _seek_flush();
+            }
+            pa_threaded_mainloop_unlock(pa_ml);
         }
         break;
     case DB_EV_VOLUMECHANGED:
@@ -825,11 +3781,56 @@ pulse_message (uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2) {
         break;
     case DB_EV_CONFIGCHANGED:
         plugin.has_volume = deadbeef->conf_get_int(CONFSTR_PULSE_VOLUMECONTROL, PULSE_DEFAULT_VOLUMECONTROL);
+        if (pa_ml) {
+            char dev[sizeof (preferred_sink)];
+            deadbeef->conf_get_str (PULSE_PLUGIN_ID "_soundcard", "default", dev, sizeof (dev));
+
+            pa_threaded_mainloop_lock(pa_ml);
+            if (pa_s && strcmp(dev, preferred_sink)) {
+                // Another device was picked, move the live stream there
+                strcpy(preferred_sink, dev);
+                _sink_move_preferred();
+            }
+            if (!stats_timer) {
+                _stats_timer_arm();
+            }
+            pa_threaded_mainloop_unlock(pa_ml);
+        }
         break;
     }
     return 0;
 }
 
+static int
+pulse_action_dump_stats (DB_plugin_action_t *action, ddb_action_context_t ctx)
+{
+    // GUI thread, mutex keeps pulse_free() from tearing pa_ml down meanwhile
+    deadbeef->mutex_lock(mutex);
+    if (pa_ml) {
+        pa_threaded_mainloop_lock(pa_ml);
+    }
+    _stats_dump();
+    if (pa_ml) {
+        pa_threaded_mainloop_unlock(pa_ml);
+    }
+    deadbeef->mutex_unlock(mutex);
+    return 0;
+}
+
+static DB_plugin_action_t dump_stats_action = {
+    .title = "Playback/Dump PulseAudio output statistics",
+    .name = "pulse2_dump_stats",
+    .flags = DB_ACTION_COMMON | DB_ACTION_ADD_MENU,
+    .callback2 = pulse_action_dump_stats,
+    .next = NULL
+};
+
+static DB_plugin_action_t *
+pulse_get_actions (DB_playItem_t *it)
+{
+    return &dump_stats_action;
+}
+
 struct enum_card_userdata {
     void (*callback)(const char *name, const char *desc, void *);
     void *userdata;
@@ -845,17 +3846,8 @@ sink_info_callback(pa_context *c, const pa_sink_info *i, int eol, void *userdata
         return;
     }
 
-    // Avoid crazy long descriptions, they grow the GTK dropdown box in deadbeef GUI
-    // Truncate with a middle ellipsis so we catch output port names that are always at the end
     char buf[256];
-    if (strlen(i->description) > 80) {
-        strncpy (buf, i->description, 38);
-        strcat(buf, "...");
-        strcat (buf, i->description+strlen(i->description)-38);
-        
-    } else {
-        strcpy(buf, i->description ? i->description : "");
-    }
+    _sink_description(i->description, buf, sizeof(buf));
 
     ud->callback(i->name ? i->name : "", buf, ud->userdata);
 }
@@ -894,6 +3886,17 @@ pulse_enum_soundcards(void (*callback)(const char *name, const char *desc, void
     int ret;
     struct enum_card_userdata ud = {callback, userdata};
 
+    deadbeef->mutex_lock(sinks_mutex);
+    if (sinks_valid) {
+        for (struct sink_entry *e = sinks; e; e = e->next) {
+            callback(e->name, e->desc, userdata);
+        }
+        deadbeef->mutex_unlock(sinks_mutex);
+        return;
+    }
+    deadbeef->mutex_unlock(sinks_mutex);
+
+    // Not connected, ask the server directly
     pa_mainloop *ml = pa_mainloop_new();
     ud.ml = ml;
     pa_mainloop_api *api = pa_mainloop_get_api(ml);
@@ -938,7 +3941,30 @@ static const char settings_dlg[] =
     "property \"PulseAudio server (leave empty for default)\" entry " CONFSTR_PULSE_SERVERADDR " \"\";\n"
     "property \"Preferred buffer size in ms\" entry " CONFSTR_PULSE_BUFFERSIZE " " STR(PULSE_DEFAULT_BUFFERSIZE) ";\n"
     "property \"Use pulseaudio volume control\" checkbox " CONFSTR_PULSE_VOLUMECONTROL " " STR(PULSE_DEFAULT_VOLUMECONTROL) ";\n"
-    "property \"Pause instead of mute when corked (e.g. when receiving calls)\" checkbox " CONFSTR_PULSE_PAUSEONCORK " " STR(PULSE_DEFAULT_PAUSEONCORK) ";\n";
+    "property \"Pause instead of mute when corked (e.g. when receiving calls)\" checkbox " CONFSTR_PULSE_PAUSEONCORK " " STR(PULSE_DEFAULT_PAUSEONCORK) ";\n"
+    "property \"Keep connection to server open when stopped\" checkbox " CONFSTR_PULSE_PERSISTENT " " STR(PULSE_DEFAULT_PERSISTENT) ";\n"
+    "property \"Close idle connection after seconds (0 = never)\" entry " CONFSTR_PULSE_IDLETIMEOUT " " STR(PULSE_DEFAULT_IDLETIMEOUT) ";\n"
+    "property \"Decode ahead buffer in ms (0 = read in write callback)\" entry " CONFSTR_PULSE_PREFETCH " " STR(PULSE_DEFAULT_PREFETCH) ";\n"
+    "property \"Cork stream after ms of silence (0 = never)\" entry " CONFSTR_PULSE_AUTOCORK " " STR(PULSE_DEFAULT_AUTOCORK) ";\n"
+    "property \"Adapt buffer size to underruns\" checkbox " CONFSTR_PULSE_ADAPTIVE " " STR(PULSE_DEFAULT_ADAPTIVE) ";\n"
+    "property \"Adaptive buffer minimum in ms\" entry " CONFSTR_PULSE_ADAPTIVE_MIN " " STR(PULSE_DEFAULT_ADAPTIVE_MIN) ";\n"
+    "property \"Adaptive buffer maximum in ms\" entry " CONFSTR_PULSE_ADAPTIVE_MAX " " STR(PULSE_DEFAULT_ADAPTIVE_MAX) ";\n"
+    "property \"Low latency mode (server adjusts latency to buffer size)\" checkbox " CONFSTR_PULSE_LOWLATENCY " " STR(PULSE_DEFAULT_LOWLATENCY) ";\n"
+    "property \"Minimum request size in ms (0 = server default)\" entry " CONFSTR_PULSE_MINREQ " " STR(PULSE_DEFAULT_MINREQ) ";\n"
+    "property \"Prebuffer in ms (-1 = server default)\" entry " CONFSTR_PULSE_PREBUF " " STR(PULSE_DEFAULT_PREBUF) ";\n"
+    "property \"Log statistics every seconds (0 = never)\" entry " CONFSTR_PULSE_STATSINTERVAL " " STR(PULSE_DEFAULT_STATSINTERVAL) ";\n"
+    "property \"Reconnect and keep playing when the server goes away\" checkbox " CONFSTR_PULSE_RECONNECT " " STR(PULSE_DEFAULT_RECONNECT) ";\n"
+    "property \"Drop buffered audio on seek\" checkbox " CONFSTR_PULSE_SEEKFLUSH " " STR(PULSE_DEFAULT_SEEKFLUSH) ";\n"
+    "property \"Track playback clock and latency\" checkbox " CONFSTR_PULSE_TIMING " " STR(PULSE_DEFAULT_TIMING) ";\n"
+    "property \"Play in the output device's native format\" checkbox " CONFSTR_PULSE_NATIVEFORMAT " " STR(PULSE_DEFAULT_NATIVEFORMAT) ";\n"
+    "property \"Convert float to the native format in the plugin\" checkbox " CONFSTR_PULSE_CONVERT " " STR(PULSE_DEFAULT_CONVERT) ";\n"
+    "property \"IEC 61937 passthrough (S/PDIF AC-3, DTS)\" checkbox " CONFSTR_PULSE_PASSTHROUGH " " STR(PULSE_DEFAULT_PASSTHROUGH) ";\n"
+    "property \"Also play on these sinks (comma separated names)\" entry " CONFSTR_PULSE_FANOUT " \"\";\n"
+    "property \"Real-time priority for the audio threads\" checkbox " CONFSTR_PULSE_REALTIME " " STR(PULSE_DEFAULT_REALTIME) ";\n"
+    "property \"Real-time priority (1-99)\" entry " CONFSTR_PULSE_RTPRIO " " STR(PULSE_DEFAULT_RTPRIO) ";\n"
+    "property \"Real-time policy (0 = SCHED_FIFO, 1 = SCHED_RR)\" entry " CONFSTR_PULSE_RTPOLICY " " STR(PULSE_DEFAULT_RTPOLICY) ";\n"
+    "property \"Nice level when real-time is not permitted\" entry " CONFSTR_PULSE_NICE " " STR(PULSE_DEFAULT_NICE) ";\n"
+    "property \"Pin audio threads to CPUs (e.g. 2,3)\" entry " CONFSTR_PULSE_CPUS " \"\";\n";
 
 static DB_output_t plugin =
 {
@@ -973,6 +3999,7 @@ static DB_output_t plugin =
     .plugin.stop = pulse_plugin_stop,
     .plugin.configdialog = settings_dlg,
     .plugin.message = pulse_message,
+    .plugin.get_actions = pulse_get_actions,
     .init = pulse_init,
     .free = pulse_free,
     .setformat = pulse_setformat,